@@ -48,7 +48,8 @@ InsertAppendExecCustomScan(CustomScanState *node)
 {
     AppendScanState  *state = (AppendScanState *) node;
 
-    ExecInsertAppendTable(state->OriginalPlanState);
+    ExecInsertAppendTable(state->OriginalPlanState, state->SourcePlan,
+                          state->nworkers);
     
 	return NULL;
 }		
@@ -92,6 +93,13 @@ InsertAppendExecutorCreateScan(CustomScan *scan)
     /* store the Original Plan as this is the one we want */
     scanState->OriginalPlan = (PlannedStmt *) linitial(scan->custom_private);
 
+    /* and the source query planned to run in parallel, if any */
+    if (list_length(scan->custom_private) > 1)
+    {
+        scanState->SourcePlan = (PlannedStmt *) lsecond(scan->custom_private);
+        scanState->nworkers = intVal(lthird(scan->custom_private));
+    }
+
     scanState->customScanState.methods = &DirectAppendExecutorCustomExecMethods;
 
     return (Node *) scanState;
@@ -12,6 +12,7 @@
 
 #include "include/hooks.h"
 #include "include/cscan.h"
+#include "include/insert_append_parallel.h"
 
 #if PG_VERSION_NUM >= PG_VERSION_13
 #define standard_planner_compat(a, c, d) standard_planner(a, NULL, c, d)
@@ -19,13 +20,22 @@
 #define standard_planner_compat(a, c, d) standard_planner(a, c, d)
 #endif
 
+planner_hook_type prev_planner_hook = NULL;
+post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
+
 bool insert_append_candidate = false;
 
+/* number of workers asked for by the PARALLEL(n) hint, 0 if none */
+int insert_append_parallel_workers = 0;
+
 typedef struct InsertAppendPlanningContext
 {
     /* the parsed query */
     Query *query;
 
+    /* its source text, NULL before PostgreSQL 13 */
+    const char *queryString;
+
     /* the cursor options */
     int cursorOptions;
 
@@ -35,10 +45,14 @@ typedef struct InsertAppendPlanningContext
     /* plan created either by standard_planner or by our planner */
     PlannedStmt *plan;
 
+    /* copy of the query, to plan its source query apart */
+    Query *sourceQuery;
+
 } InsertAppendPlanningContext;
 
 /* our planner */
 static PlannedStmt * PlanInsertAppendStmt(InsertAppendPlanningContext *planContext);
+static int InsertAppendParallelHint(const char *sourcetext);
 
 /*
  * Planner hook.
@@ -53,12 +67,19 @@ InsertAppend_planner(Query *parse,
 {
     InsertAppendPlanningContext planContext = {
 		.query = parse,
+#if PG_VERSION_NUM >= PG_VERSION_13
+		.queryString = query_string,
+#endif
 		.cursorOptions = cursorOptions,
 		.boundParams = boundParams,
 	};
 
     PlannedStmt *result = NULL;
 
+    /* the planner scribbles on the query */
+    if (parse->commandType == CMD_INSERT && insert_append_candidate)
+        planContext.sourceQuery = copyObject(parse);
+
     if (prev_planner_hook)
 		planContext.plan = (*prev_planner_hook) (planContext.query,
 #if PG_VERSION_NUM >= PG_VERSION_13
@@ -81,6 +102,7 @@ InsertAppend_planner(Query *parse,
     {
         result = PlanInsertAppendStmt(&planContext);
         insert_append_candidate = false;
+        insert_append_parallel_workers = 0;
     }
     else
     {
@@ -95,6 +117,8 @@ PlanInsertAppendStmt(InsertAppendPlanningContext *planContext)
 {
 
 	PlannedStmt *resultPlan = NULL;
+	PlannedStmt *sourcePlan = NULL;
+	int nworkers = insert_append_parallel_workers;
 	CustomScan *customScan = makeNode(CustomScan);
 
 	customScan->methods = &insert_append_plan_methods;
@@ -103,8 +127,23 @@ PlanInsertAppendStmt(InsertAppendPlanningContext *planContext)
     customScan->custom_scan_tlist = planContext->plan->planTree->targetlist;
     customScan->scan.plan.targetlist = customScan->custom_scan_tlist;
 
+    /*
+     * An insert is never planned in parallel: plan its source query apart,
+     * for parallel workers reading or also storing the rows.
+     */
+    if (planContext->sourceQuery != NULL)
+        sourcePlan = IAParallelPlan(planContext->sourceQuery,
+                                    planContext->queryString,
+                                    planContext->cursorOptions,
+                                    planContext->boundParams,
+                                    &nworkers);
+
     /* save the original plan as we want to use it later on */
-    customScan->custom_private = list_make1(planContext->plan);
+    if (sourcePlan != NULL)
+        customScan->custom_private = list_make3(planContext->plan, sourcePlan,
+                                                makeInteger(nworkers));
+    else
+        customScan->custom_private = list_make1(planContext->plan);
     
     /* create our new plan */
     resultPlan = makeNode(PlannedStmt);
@@ -116,6 +155,7 @@ PlanInsertAppendStmt(InsertAppendPlanningContext *planContext)
     resultPlan->canSetTag = true;
     resultPlan->transientPlan = planContext->plan->transientPlan;
     resultPlan->dependsOnRole = planContext->plan->dependsOnRole;
+    /* the source query enters parallel mode itself, the insert is serial */
     resultPlan->parallelModeNeeded = false;
 #if PG_VERSION_NUM >= PG_VERSION_11
     resultPlan->jitFlags = planContext->plan->jitFlags;
@@ -143,6 +183,8 @@ InsertAppend_post_parse_analyze(ParseState *pstate, Query *query
 #endif
 )
 {
+    int nworkers = InsertAppendParallelHint(pstate->p_sourcetext);
+
     if (prev_post_parse_analyze_hook)
         prev_post_parse_analyze_hook(pstate, query
 #if PG_VERSION_NUM >= PG_VERSION_14
@@ -150,8 +192,30 @@ InsertAppend_post_parse_analyze(ParseState *pstate, Query *query
 #endif
         );
     /* check if the target relation is candidate for insert append */
-    if (strstr(pstate->p_sourcetext, "/*+ APPEND */")
+    if ((strstr(pstate->p_sourcetext, "/*+ APPEND */") || nworkers > 0)
         && (pstate->p_target_relation)
         && (pstate->p_target_relation->rd_rel->relkind == RELKIND_RELATION))
+    {
             insert_append_candidate = true;
+            insert_append_parallel_workers = nworkers;
+    }
+}
+
+/*
+ * Number of workers asked for by an APPEND PARALLEL(n) hint, 0 if there is
+ * none.
+ */
+static int
+InsertAppendParallelHint(const char *sourcetext)
+{
+    const char *hint = strstr(sourcetext, "/*+ APPEND PARALLEL(");
+    int         nworkers;
+    int         end = 0;
+
+    if (hint == NULL ||
+        sscanf(hint + strlen("/*+ APPEND PARALLEL("), "%d) */%n", &nworkers, &end) != 1 ||
+        end == 0 || nworkers <= 0)
+        return 0;
+
+    return nworkers;
 }
\ No newline at end of file
@@ -15,7 +15,8 @@ extern TupleTableSlot *InsertAppendExecCustomScan(CustomScanState *node);
 extern void InsertAppendExecEndCustomScan(CustomScanState *node);
 extern void InsertAppendExecReScanCustomScan(CustomScanState *node);
 extern void InsertAppendExplainCustomScan(CustomScanState *node, List *ancestors, ExplainState *es);
-extern TupleTableSlot *ExecInsertAppendTable(PlanState *pstate);
+extern TupleTableSlot *ExecInsertAppendTable(PlanState *pstate,
+											 PlannedStmt *source_plan, int nworkers);
 extern void ExecEndInsertAppendTable(PlanState *pstate);
 
 typedef struct AppendScanState
@@ -23,6 +24,8 @@ typedef struct AppendScanState
     CustomScanState customScanState;
     PlannedStmt  *OriginalPlan;
     PlanState *OriginalPlanState;
+    PlannedStmt  *SourcePlan;    /* source query run in parallel, or NULL */
+    int nworkers;                /* workers storing rows, 0 if they only read */
 } AppendScanState;
 
 #endif  /* CSCAN_H */
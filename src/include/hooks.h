@@ -6,8 +6,8 @@
 #include "parser/analyze.h"
 #include "funcapi.h"
 
-static planner_hook_type prev_planner_hook = NULL;
-static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
+extern planner_hook_type prev_planner_hook;
+extern post_parse_analyze_hook_type prev_post_parse_analyze_hook;
 
 extern void InsertAppendExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
                              bool execute_once);
@@ -0,0 +1,53 @@
+#ifndef IA_H
+#define IA_H
+
+#include "pg_directpaths.h"
+#include "access/htup.h"
+#include "access/xact.h"
+#include "port/atomics.h"
+#include "storage/backendid.h"
+#include "storage/block.h"
+#include "storage/relfilenode.h"
+#include "utils/guc.h"
+
+typedef enum IASyncMode
+{
+	IA_SYNC_MODE_IMMEDIATE,		/* fsync the files when they are closed */
+	IA_SYNC_MODE_CHECKPOINTER	/* register them for the next checkpoint */
+} IASyncMode;
+
+/*
+ * What a direct path writer needs to know about the relation it appends
+ * to, without opening it: the page builder of a pipelined insert does not.
+ */
+typedef struct IAWriterParams
+{
+	RelFileNode	node;
+	BackendId	backend;
+	BlockNumber	blks_initial_cnt;	/* number of blocks before the insert */
+	BlockNumber	blks_estimated;	/* number of blocks the planner expects */
+	Size		target_free;	/* free space to leave in each page */
+	bool		use_wal;		/* WAL-log the new pages */
+	bool		sync_checkpointer;	/* leave the files fsync to the checkpointer */
+} IAWriterParams;
+
+typedef struct InsertAppendWriter InsertAppendWriter;
+
+extern bool ia_preallocate;
+extern int	ia_max_buffer_size;
+extern int	ia_sync_mode;
+extern const struct config_enum_entry ia_sync_mode_options[];
+
+extern void IAWriterXactCallback(XactEvent event, void *arg);
+extern void IAWriterSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+									SubTransactionId parentSubid, void *arg);
+
+extern InsertAppendWriter *IAWriterOpen(IAWriterParams *params,
+										TransactionId xid, CommandId cid,
+										pg_atomic_uint32 *shared_blocks);
+extern void IAWriterInsert(InsertAppendWriter *writer, HeapTuple tuple);
+extern void IAWriterClose(InsertAppendWriter *writer);
+
+extern PGDLLEXPORT void IAPipelineWorkerMain(Datum main_arg);
+
+#endif   /* IA_H */
@@ -0,0 +1,18 @@
+#ifndef IABTREE_H
+#define IABTREE_H
+
+#include "pg_directpaths.h"
+#include "access/itup.h"
+#include "utils/relcache.h"
+
+typedef struct IABtreeLoader IABtreeLoader;
+
+typedef void (*IABtreeUnloadCallback) (IndexTuple itup, void *arg);
+
+extern IABtreeLoader *IABtreeLoadBegin(Relation heapRel, Relation index);
+extern void IABtreeLoadAdd(IABtreeLoader *loader, IndexTuple itup);
+extern double IABtreeLoadEnd(IABtreeLoader *loader);
+extern void IABtreeLoadUnload(IABtreeLoader *loader,
+							  IABtreeUnloadCallback callback, void *arg);
+
+#endif   /* IABTREE_H */
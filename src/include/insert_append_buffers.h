@@ -0,0 +1,14 @@
+#ifndef IABUF_H
+#define IABUF_H
+
+#include "pg_directpaths.h"
+#include "utils/guc.h"
+
+extern int	ia_huge_pages;
+extern const struct config_enum_entry ia_huge_pages_options[];
+extern int	ia_buffer_pool_size;
+
+extern char *IABufferGet(Size size, Size *allocated);
+extern void IABufferRelease(char *buf, Size size);
+
+#endif   /* IABUF_H */
@@ -1,8 +1,23 @@
 #ifndef IAINDEXES_H
 #define IAINDEXES_H
 
+#include "access/htup.h"
 #include "nodes/execnodes.h"
+#include "storage/block.h"
+#include "storage/dsm.h"
+#include "storage/shm_toc.h"
 
-extern void IARebuildIndexes(ResultRelInfo *resultRelInfo);
+extern int	ia_index_merge_ratio;
+extern bool ia_index_spool;
+
+typedef struct IAIndexSpool IAIndexSpool;
+
+extern IAIndexSpool *IAIndexSpoolStart(Relation heapRel);
+extern void IAIndexSpoolAdd(IAIndexSpool *spool, HeapTuple tuple,
+							ItemPointer tid);
+extern void IARebuildIndexes(ResultRelInfo *resultRelInfo, BlockNumber startblk,
+							 IAIndexSpool *spool);
+
+extern PGDLLEXPORT void IABuildIndexesMain(dsm_segment *seg, shm_toc *toc);
 
 #endif   /* IAINDEXES_H */
\ No newline at end of file
@@ -0,0 +1,77 @@
+#ifndef IAIO_H
+#define IAIO_H
+
+#include "pg_directpaths.h"
+#include "utils/guc.h"
+
+#include <aio.h>
+#include <fcntl.h>
+
+#define IA_MAX_IO_REQUESTS	16
+
+/* io_uring writes are split in pieces of at least that size, in flight together */
+#define IA_IO_WRITE_SIZE	(1024 * 1024)
+
+/* memory, offset and size alignment required by direct I/O */
+#define IA_IO_ALIGN			4096
+
+/* upper bound of pg_directpaths.writeback_chunks */
+#define IA_MAX_WRITEBACKS	64
+
+#if defined(O_DIRECT)
+#define IA_O_DIRECT			O_DIRECT
+#else
+#define IA_O_DIRECT			0
+#endif
+
+typedef enum IAIOMethod
+{
+	IA_IO_METHOD_SYNC,
+	IA_IO_METHOD_POSIX_AIO,
+#ifdef USE_LIBURING
+	IA_IO_METHOD_IO_URING,
+#endif
+} IAIOMethod;
+
+/* the asynchronous methods are opt-in */
+#define IA_IO_METHOD_DEFAULT	IA_IO_METHOD_SYNC
+
+typedef struct IAIORequest
+{
+	int				fd;
+	char		   *buf;
+	size_t			len;
+	off_t			offset;
+	bool			fsync;	/* fsync of the file rather than a write */
+	bool			done;	/* completion collected */
+	int				result;	/* bytes written, or -errno */
+	struct aiocb	cb;		/* posix_aio control block */
+} IAIORequest;
+
+/*
+ * Writes issued from one buffer of the direct path writer, or fsyncs of
+ * its segment files.  The buffer content must not be modified until
+ * IAIOWait() returned.
+ */
+typedef struct IAIORequests
+{
+	int				method;	/* method of the requests in flight */
+	int				count;	/* number of requests in flight */
+	IAIORequest		reqs[IA_MAX_IO_REQUESTS];
+} IAIORequests;
+
+extern int	ia_io_method;
+extern const struct config_enum_entry ia_io_method_options[];
+extern bool ia_direct_io;
+extern int	ia_writeback_chunks;
+
+extern void IAIOWrite(IAIORequests *reqs, int fd, char *buf, size_t len,
+					  off_t offset);
+extern void IAIOFsync(IAIORequests *reqs, int fd);
+extern void IAIOReap(void);
+extern bool IAIOPoll(IAIORequests *reqs);
+extern void IAIOWait(IAIORequests *reqs);
+extern void IAIOCancel(IAIORequests *reqs);
+extern void IAIOForgetWriteback(int fd);
+
+#endif   /* IAIO_H */
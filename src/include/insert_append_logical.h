@@ -0,0 +1,52 @@
+#ifndef IALOGICAL_H
+#define IALOGICAL_H
+
+#include "pg_directpaths.h"
+#include "access/htup.h"
+#include "access/tupdesc.h"
+#include "lib/stringinfo.h"
+
+/* prefix of the logical messages of the direct path inserts */
+#define IA_LOGICAL_PREFIX		"pg_directpaths"
+
+/* a batch is emitted once it gets that large, or at the end of a chunk */
+#define IA_LOGICAL_BATCH_SIZE	(8 * 1024 * 1024)
+
+/*
+ * Transactional logical message holding rows added by a direct path insert:
+ * this header, then for each row an IALogicalTuple followed by what comes
+ * after the fixed size tuple header.  External values are inlined.
+ */
+typedef struct IALogicalRows
+{
+	Oid			relid;
+	uint32		ntuples;
+} IALogicalRows;
+
+/* row of an IALogicalRows message, stored unaligned */
+typedef struct IALogicalTuple
+{
+	uint32		t_len;
+	uint16		t_infomask2;
+	uint16		t_infomask;
+	uint8		t_hoff;
+} IALogicalTuple;
+
+#define SizeOfIALogicalTuple	(offsetof(IALogicalTuple, t_hoff) + sizeof(uint8))
+
+/* rows of a writer not emitted yet */
+typedef struct IALogicalBatch
+{
+	Oid			relid;
+	uint32		ntuples;
+	StringInfoData data;
+} IALogicalBatch;
+
+extern bool ia_logical_messages;
+
+extern IALogicalBatch *IALogicalStart(Oid relid, MemoryContext mcxt);
+extern void IALogicalAddRow(IALogicalBatch *batch, HeapTuple tuple,
+							TupleDesc tupdesc);
+extern void IALogicalFlush(IALogicalBatch *batch);
+
+#endif   /* IALOGICAL_H */
@@ -0,0 +1,44 @@
+#ifndef IAPARALLEL_H
+#define IAPARALLEL_H
+
+#include "pg_directpaths.h"
+#include "executor/execdesc.h"
+#include "nodes/extensible.h"
+#include "nodes/params.h"
+#include "nodes/parsenodes.h"
+#include "port/atomics.h"
+#include "insert_append.h"
+
+/*
+ * Parallel direct path insert: the workers of a Gather each run an Insert
+ * Append Worker node, storing the rows of their part of the source query
+ * with their own writer.  The writers of the leader and of the workers
+ * reserve the blocks they write from a counter in a segment of the leader,
+ * so that they fill disjoint ranges.
+ */
+typedef struct IAParallel IAParallel;
+
+extern CustomScanMethods insert_append_worker_plan_methods;
+
+extern PlannedStmt *IAParallelPlan(Query *query, const char *query_string,
+								   int cursorOptions,
+								   ParamListInfo boundParams, int *nworkers);
+
+extern IAParallel *IAParallelBegin(IAWriterParams *params, Oid relid,
+								   TransactionId xid, CommandId cid,
+								   MemoryContext mcxt);
+extern pg_atomic_uint32 *IAParallelBlocks(IAParallel *parallel);
+extern uint64 IAParallelProcessed(IAParallel *parallel);
+extern void IAParallelEnd(IAParallel *parallel);
+
+/*
+ * Source query of the insert, planned as a SELECT so that it may run in
+ * parallel, and executed apart from the insert plan.
+ */
+typedef struct IASource IASource;
+
+extern IASource *IASourceStart(PlannedStmt *plan, EState *estate);
+extern TupleTableSlot *IASourceNext(IASource *source);
+extern void IASourceEnd(IASource *source);
+
+#endif   /* IAPARALLEL_H */
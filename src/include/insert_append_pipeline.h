@@ -0,0 +1,28 @@
+#ifndef IAPIPELINE_H
+#define IAPIPELINE_H
+
+#include "pg_directpaths.h"
+#include "storage/bufpage.h"
+#include "insert_append.h"
+
+/*
+ * Pipelined direct path insert: the leader sends the rows, ready to be
+ * stored, through a shared memory queue to a background worker that puts
+ * them on pages, WAL-logs and writes them.
+ */
+typedef struct IAPipeline IAPipeline;
+
+extern bool ia_pipeline;
+
+/* leader side */
+extern IAPipeline *IAPipelineStart(IAWriterParams *params, MemoryContext mcxt);
+extern void IAPipelineSend(IAPipeline *pipe, Item item, uint32 len);
+extern BlockNumber IAPipelineFinish(IAPipeline *pipe);
+extern void IAPipelineStop(IAPipeline *pipe);
+
+/* page builder side */
+extern IAPipeline *IAPipelineAttach(Datum main_arg, IAWriterParams *params);
+extern bool IAPipelineReceive(IAPipeline *pipe, Item *item, uint32 *len);
+extern void IAPipelineDone(IAPipeline *pipe, BlockNumber nblocks);
+
+#endif   /* IAPIPELINE_H */
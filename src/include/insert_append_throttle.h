@@ -0,0 +1,14 @@
+#ifndef IATHROTTLE_H
+#define IATHROTTLE_H
+
+#include "pg_directpaths.h"
+
+extern int	ia_max_wal_rate;
+extern int	ia_max_write_rate;
+extern int	ia_max_replication_lag;
+extern int	ia_replication_lag_timeout;
+
+extern void IAThrottleStart(void);
+extern void IAThrottle(uint64 wal_bytes, uint64 write_bytes);
+
+#endif   /* IATHROTTLE_H */
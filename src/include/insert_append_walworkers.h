@@ -0,0 +1,30 @@
+#ifndef IAWALWORKERS_H
+#define IAWALWORKERS_H
+
+#include "pg_directpaths.h"
+#include "storage/block.h"
+#include "storage/relfilenode.h"
+
+/* upper bound of pg_directpaths.wal_workers */
+#define IA_MAX_WAL_WORKERS	16
+
+/*
+ * Background workers WAL-logging and checksumming the chunks of a direct
+ * path writer, whose buffers then live in a shared memory segment.
+ */
+typedef struct IAWalWorkers IAWalWorkers;
+
+extern int	ia_wal_workers;
+
+extern IAWalWorkers *IAWalWorkersStart(RelFileNode node, int nbuffers,
+									   Size buffer_size, MemoryContext mcxt);
+extern char *IAWalWorkersBuffer(IAWalWorkers *workers, int buf);
+extern void IAWalWorkersLog(IAWalWorkers *workers, int buf, int num,
+							BlockNumber blkno);
+extern bool IAWalWorkersDone(IAWalWorkers *workers);
+extern uint64 IAWalWorkersWait(IAWalWorkers *workers);
+extern void IAWalWorkersStop(IAWalWorkers *workers);
+
+extern PGDLLEXPORT void IAWalWorkerMain(Datum main_arg);
+
+#endif   /* IAWALWORKERS_H */
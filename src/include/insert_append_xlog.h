@@ -0,0 +1,95 @@
+#ifndef IAXLOG_H
+#define IAXLOG_H
+
+#include "pg_directpaths.h"
+#include "access/xlogreader.h"
+#include "lib/stringinfo.h"
+#include "storage/block.h"
+#include "storage/bufpage.h"
+#include "storage/relfilenode.h"
+#include "utils/guc.h"
+
+/*
+ * Custom WAL resource manager, available from PostgreSQL 15 when the
+ * library is loaded through shared_preload_libraries.  Its ID must not be
+ * used by another extension of the cluster, see the list kept at
+ * https://wiki.postgresql.org/wiki/CustomWALResourceManagers.  A build can
+ * pick another one with COPT=-DIA_RMGR_ID=n.
+ */
+#ifndef IA_RMGR_ID
+#define IA_RMGR_ID			141
+#endif
+#define IA_RMGR_NAME		"pg_directpaths"
+
+/* pages written by a direct path insert, compressed as a whole */
+#define XLOG_IA_PAGES		0x00
+/* same, as the tuples they hold */
+#define XLOG_IA_ROWS		0x10
+
+/* pages logged by one record */
+#define IA_XLOG_PAGES_PER_RECORD	256
+
+typedef enum IAWalCompression
+{
+	IA_WAL_COMPRESSION_NONE,
+	IA_WAL_COMPRESSION_PGLZ,
+	IA_WAL_COMPRESSION_LZ4,
+	IA_WAL_COMPRESSION_ZSTD
+} IAWalCompression;
+
+/*
+ * Records of npages pages from block blkno.  The data is compressed with
+ * method.
+ *
+ * XLOG_IA_PAGES: the header is followed by npages pairs of hole offset and
+ * length, then by the pages without their hole.
+ *
+ * XLOG_IA_ROWS: the header is followed by the number of tuples (uint16) of
+ * each page and its tuples.  They are stored as an xl_ia_tuple followed by
+ * what comes after the fixed size tuple header, and added in order to the
+ * initialized page, with the xmin and cmin of the record.
+ */
+typedef struct xl_ia_pages
+{
+	RelFileNode node;
+	ForkNumber	forknum;
+	BlockNumber	blkno;		/* first block, the others follow */
+	TransactionId xmin;		/* XLOG_IA_ROWS only */
+	CommandId	cmin;		/* XLOG_IA_ROWS only */
+	uint16		npages;
+	uint8		method;		/* IAWalCompression */
+	uint32		raw_len;	/* length of the pages without their hole */
+	uint32		data_len;	/* length of the stored data */
+} xl_ia_pages;
+
+#define SizeOfIAPages	(offsetof(xl_ia_pages, data_len) + sizeof(uint32))
+
+/* tuple of an XLOG_IA_ROWS record, stored unaligned */
+typedef struct xl_ia_tuple
+{
+	uint16		t_len;
+	uint16		t_infomask2;
+	uint16		t_infomask;
+	uint8		t_hoff;
+} xl_ia_tuple;
+
+#define SizeOfIATuple	(offsetof(xl_ia_tuple, t_hoff) + sizeof(uint8))
+
+extern int	ia_wal_compression;
+extern const struct config_enum_entry ia_wal_compression_options[];
+extern bool ia_wal_row_images;
+extern bool ia_direct_redo;
+
+extern void IAXLogInit(void);
+extern bool IAXLogPages(RelFileNode *rnode, ForkNumber forknum, int num_pages,
+						BlockNumber *blknos, Page *pages);
+extern uint64 IAXLogNewPages(RelFileNode *rnode, ForkNumber forknum,
+							 int num_pages, BlockNumber *blknos, Page *pages);
+
+#if PG_VERSION_NUM >= PG_VERSION_15
+extern void ia_xlog_redo(XLogReaderState *record);
+extern void ia_xlog_desc(StringInfo buf, XLogReaderState *record);
+extern const char *ia_xlog_identify(uint8 info);
+#endif
+
+#endif   /* IAXLOG_H */
@@ -17,6 +17,16 @@
 #error pg_directpaths does not support PostgreSQL 9 or earlier versions.
 #endif
 
+/*
+ * Latch waits end with the postmaster.  Before PostgreSQL 12, the caller
+ * has to exit when WL_POSTMASTER_DEATH is returned.
+ */
+#if PG_VERSION_NUM >= PG_VERSION_12
+#define IA_WL_EXIT	WL_EXIT_ON_PM_DEATH
+#else
+#define IA_WL_EXIT	WL_POSTMASTER_DEATH
+#endif
+
 extern void IAExplainNode(PlanState *planstate, List *ancestors,
                     const char *relationship, const char *plan_name,
                     ExplainState *es);
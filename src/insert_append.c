@@ -10,105 +10,397 @@
  *
  */
 
+#include <fcntl.h>
+#include <math.h>
 #include <unistd.h>
 #include "include/pg_directpaths.h"
 #include "access/xact.h"
+#include "access/xlog.h"
 #include "commands/trigger.h"
 #include "foreign/fdwapi.h"
+#include "postmaster/bgworker.h"
 #include "storage/bufmgr.h"
+#include "storage/ipc.h"
+#include "storage/proc.h"
+#include "tcop/tcopprot.h"
 #include "include/cscan.h"
+#include "include/insert_append.h"
+#include "include/insert_append_buffers.h"
 #include "include/insert_append_indexes.h"
+#include "include/insert_append_io.h"
+#include "include/insert_append_logical.h"
+#include "include/insert_append_parallel.h"
+#include "include/insert_append_pipeline.h"
+#include "include/insert_append_throttle.h"
+#include "include/insert_append_walworkers.h"
+#include "include/insert_append_xlog.h"
 
 #if PG_VERSION_NUM >= PG_VERSION_16
 #error unsupported PostgreSQL version
 #elif PG_VERSION_NUM >= PG_VERSION_15
 #include "corepg/nodeModifyTable_15.c"
 #include "access/heaptoast.h"
-#include "access/xloginsert.h"
+#include "storage/sync.h"
 #elif PG_VERSION_NUM >= PG_VERSION_14
 #include "corepg/nodeModifyTable_14.c"
 #include "access/heaptoast.h"
+#include "storage/sync.h"
 #elif PG_VERSION_NUM >= PG_VERSION_13
 #include "corepg/nodeModifyTable_13.c"
 #include "access/heaptoast.h"
-#include "catalog/pg_control.h"
+#include "storage/sync.h"
 #elif PG_VERSION_NUM >= PG_VERSION_12
 #include "corepg/nodeModifyTable_12.c"
 #include "access/tuptoaster.h"
-#include "catalog/pg_control.h"
+#include "storage/sync.h"
 #elif PG_VERSION_NUM >= PG_VERSION_11
 #include "corepg/nodeModifyTable_11.c"
 #include "access/tuptoaster.h"
 #include "catalog/catalog.h"
-#include "catalog/pg_control.h"
+#include "postmaster/bgwriter.h"
 #elif PG_VERSION_NUM >= PG_VERSION_10
 #include "corepg/nodeModifyTable_10.c"
 #include "access/tuptoaster.h"
 #include "catalog/catalog.h"
-#include "catalog/pg_control.h"
+#include "postmaster/bgwriter.h"
 #else
 #error unsupported PostgreSQL version
 #endif
 
+#define GetCurrentBuffer(writer) \
+			(&(writer)->buffers[(writer)->curbuf])
+
 #define GetCurrentPage(writer) \
-            ((Page) ((writer)->blocks + BLCKSZ * (writer)->curblk))
+            ((Page) (GetCurrentBuffer(writer)->blocks + (Size) BLCKSZ * (writer)->curblk))
 
 #define GetTargetPage(writer, blk_offset) \
-		((Page) ((writer)->blocks + BLCKSZ * (blk_offset)))
+		((Page) (GetCurrentBuffer(writer)->blocks + (Size) BLCKSZ * (blk_offset)))
+
+/*
+ * The buffers start that small and double at each flush, up to
+ * pg_directpaths.max_buffer_size.
+ */
+#define MIN_PAGES_COUNT		16
 
-#define PAGES_COUNT		1024
+/*
+ * Number of blocks buffers: one is filled while the writes of the
+ * others are in flight.
+ */
+#define BUFFERS_COUNT	2
 
 #define BLKS_TOTAL_CNT(writer)	((writer)->blks_initial_cnt + (writer)->blks_append_cnt)
 
-typedef struct InsertAppendWriter
+/*
+ * Whether the new pages have to be WAL-logged: with wal_level = minimal, a
+ * relation created or given a new relfilenode by the current transaction
+ * is fsynced at the end of the load instead, as COPY does.
+ */
+#if PG_VERSION_NUM >= PG_VERSION_13
+#define IARelationNeedsWAL(rel)	RelationNeedsWAL(rel)
+#else
+#define IARelationNeedsWAL(rel) \
+	(RelationNeedsWAL(rel) && \
+	 (XLogIsNeeded() || \
+	  ((rel)->rd_createSubid == InvalidSubTransactionId && \
+	   (rel)->rd_newRelfilenodeSubid == InvalidSubTransactionId)))
+#endif
+
+/*
+ * Keep the checkpointer from computing its redo pointer while a segment
+ * sync is being registered.
+ */
+#if PG_VERSION_NUM >= PG_VERSION_15
+#define IADelayCheckpoint()		(MyProc->delayChkptFlags |= DELAY_CHKPT_START)
+#define IAResumeCheckpoint()	(MyProc->delayChkptFlags &= ~DELAY_CHKPT_START)
+#elif PG_VERSION_NUM >= PG_VERSION_14
+#define IADelayCheckpoint()		(MyProc->delayChkpt = true)
+#define IAResumeCheckpoint()	(MyProc->delayChkpt = false)
+#else
+#define IADelayCheckpoint()		(MyPgXact->delayChkpt = true)
+#define IAResumeCheckpoint()	(MyPgXact->delayChkpt = false)
+#endif
+
+/*
+ * Number of relation files kept opened: the fsyncs of the ones that have
+ * been filled up run along with the writes to the next ones.
+ */
+#define SEGMENTS_COUNT	4
+
+typedef struct InsertAppendSegment
+{
+	int				fd;		/* -1 when the slot is free */
+	BlockNumber		segno;	/* segment number of the file */
+	XLogRecPtr		redo;	/* redo pointer when the file was opened */
+	bool			full;	/* no more writes to come */
+	int				last_buf;	/* last buffer that wrote to it, -1 once done */
+	bool			syncing;	/* fsync started or handed over */
+	IAIORequests	sync;	/* fsync in flight */
+} InsertAppendSegment;
+
+typedef struct InsertAppendBuffer
 {
-	Relation		rel;	/* target relation */
-	char           *blocks; /* heap blocks buffer */
+	char           *blocks; /* heap blocks buffer, from the buffer pool */
+	Size			blocks_size;	/* size of the pooled buffer, 0 if shared */
+	int				nblocks;	/* capacity of the buffer */
+	BlockNumber    *ready_blknos; /* to be used as parameter of log_newpages */
+	Page           *ready_pages; /* to be written in the WAL files */
+	int				wal_num;	/* pages handed over to the WAL workers */
+	XLogRecPtr		wal_redo;	/* redo pointer from before their WAL */
+	IAIORequests	io;		/* writes in flight from this buffer */
+} InsertAppendBuffer;
+
+struct InsertAppendWriter
+{
+	Relation		rel;	/* target relation, NULL in the page builder */
+	RelFileNode		node;	/* its file */
+	BackendId		backend;
+	Size			target_free;	/* free space to leave in each page */
+	MemoryContext	mcxt;	/* holds the writer and its buffers */
+	SubTransactionId subid;	/* subtransaction that created the writer */
+	InsertAppendBuffer buffers[BUFFERS_COUNT];
+	int				curbuf;	/* buffer being filled */
+	int				pages_target;	/* capacity the buffers are resized to */
+	int				max_pages;	/* upper bound of pages_target */
 	int             curblk; /* current block buffer */
 	BlockNumber blks_initial_cnt; /* initial number of blocks part of the relation */
 	BlockNumber blks_append_cnt;	/* number of blocks created by Insert Append */
-	int				datafd;		/* fd of relation file */
+	bool			direct_io;	/* open the relation files with O_DIRECT */
+	bool			preallocate;	/* reserve the file space ahead of the writes */
+	BlockNumber		blks_estimated;	/* number of blocks the planner expects */
+	BlockNumber		prealloc_end;	/* blocks of the current file allocated up to there */
+	bool			use_wal;	/* WAL-log the new pages */
+	bool			sync_checkpointer;	/* leave the files fsync to the checkpointer */
+	IAWalWorkers   *walworkers;	/* WAL-log the pages, NULL if none */
+	IALogicalBatch *logical;	/* rows for logical decoding, NULL if not */
+	IAPipeline	   *pipeline;	/* page builder the rows go to, NULL if none */
+	IAParallel	   *parallel;	/* segment shared with the parallel workers */
+	IAIndexSpool   *spool;	/* keys of the rows for the indexes, NULL if none */
+	pg_atomic_uint32 *shared_blocks;	/* next block to reserve, NULL if not shared */
+	int				wal_buf;	/* buffer being WAL-logged by them, or -1 */
+	uint64			wal_bytes;	/* they wrote since the last flush */
+	InsertAppendSegment segments[SEGMENTS_COUNT];
+	InsertAppendSegment *curseg;	/* file being written, NULL if none */
 	TransactionId	xid;
 	CommandId		cid;
-	BlockNumber ready_blknos[PAGES_COUNT]; /* to be used as parameter of log_newpages */
-	Page        ready_pages[PAGES_COUNT]; /* to be written in the WAL files */
-} InsertAppendWriter;
-
-static void close_relation_file(InsertAppendWriter *writer);
+	struct InsertAppendWriter *next;	/* next writer still opened */
+};
+
+/* writers not closed yet, cleaned up on (sub)transaction abort */
+static InsertAppendWriter *open_writers = NULL;
+
+bool		ia_preallocate = true;
+int			ia_max_buffer_size = 65536;
+int			ia_sync_mode = IA_SYNC_MODE_IMMEDIATE;
+
+const struct config_enum_entry ia_sync_mode_options[] = {
+	{"immediate", IA_SYNC_MODE_IMMEDIATE, false},
+	{"checkpointer", IA_SYNC_MODE_CHECKPOINTER, false},
+	{NULL, 0, false}
+};
+
+static InsertAppendWriter *alloc_writer(IAWriterParams *params);
+static void start_writer(InsertAppendWriter *writer);
+static void finish_writer(InsertAppendWriter *writer);
+static void release_writer(InsertAppendWriter *writer);
+static void stamp_tuple(InsertAppendWriter *writer, HeapTuple tuple);
+static void add_tuple(InsertAppendWriter *writer, Item item, uint32 len,
+					  ItemPointer tid);
+static void reserve_blocks(InsertAppendWriter *writer,
+						   InsertAppendBuffer *buffer, int num);
+static BlockNumber estimate_blocks(Plan *plan);
+static int	allocate_file_range(int fd, off_t offset, off_t len);
+static void preallocate_blocks(InsertAppendWriter *writer, BlockNumber relblks,
+							   int nblocks);
+static void trim_preallocation(InsertAppendWriter *writer, int elevel);
+static bool register_segment_sync(InsertAppendWriter *writer, BlockNumber segno,
+								  XLogRecPtr redo);
+static InsertAppendSegment *open_segment(InsertAppendWriter *writer,
+										 BlockNumber relblks, XLogRecPtr redo);
+static void advance_segment(InsertAppendWriter *writer,
+							InsertAppendSegment *seg, bool wait);
+static bool alloc_buffer(InsertAppendWriter *writer, InsertAppendBuffer *buffer,
+						 int nblocks);
+static void release_buffer(InsertAppendBuffer *buffer);
+static void resize_buffer(InsertAppendWriter *writer);
+static void write_blocks(InsertAppendWriter *writer, InsertAppendBuffer *buffer,
+						 int num, XLogRecPtr redo);
+static uint64 write_logged_pages(InsertAppendWriter *writer);
+static void poll_logged_pages(InsertAppendWriter *writer);
 static void flush_pages(InsertAppendWriter *writer);
-#if PG_VERSION_NUM < PG_VERSION_14
-static void log_newpages(RelFileNode *rnode, ForkNumber forkNum, int num_pages,
-             BlockNumber *blknos, Page *pages, bool page_std);
-#endif
+static void wait_buffer(InsertAppendWriter *writer, int buf);
+static void wait_buffers(InsertAppendWriter *writer);
+static void abort_writers(SubTransactionId subid);
 
 static void
 DirectWriterClose(InsertAppendWriter *writer, ResultRelInfo *resultRelInfo)
 {
+	Relation	rel;
+	BlockNumber	startblk;
+	IAIndexSpool *spool;
+
 	Assert(writer != NULL);
 
-	flush_pages(writer);
-	close_relation_file(writer);
-	IARebuildIndexes(resultRelInfo);
+	if (writer->logical != NULL)
+		IALogicalFlush(writer->logical);
+
+	if (writer->pipeline != NULL)
+		writer->blks_append_cnt = IAPipelineFinish(writer->pipeline);
+	else
+		finish_writer(writer);
+
+	/* the workers are done, their blocks were written */
+	if (writer->parallel != NULL)
+		IAParallelEnd(writer->parallel);
+
+	rel = writer->rel;
+	startblk = writer->blks_initial_cnt;
+	spool = writer->spool;
+	release_writer(writer);
 
-	if (writer->rel)
+	IARebuildIndexes(resultRelInfo, startblk, spool);
+
+	if (rel)
 #if PG_VERSION_NUM >= PG_VERSION_13
-	table_close(writer->rel, AccessExclusiveLock);
+	table_close(rel, AccessExclusiveLock);
 #else
-	heap_close(writer->rel, AccessExclusiveLock);
+	heap_close(rel, AccessExclusiveLock);
 #endif
+}
+
+/*
+ * Write the last pages and wait for all the writes and fsyncs to be done.
+ */
+static void
+finish_writer(InsertAppendWriter *writer)
+{
+	int			i;
 
-	if (writer->blocks)
-		pfree(writer->blocks);
-		
-	pfree(writer);
+	flush_pages(writer);
+	write_logged_pages(writer);
+	wait_buffers(writer);
+	trim_preallocation(writer, ERROR);
+
+	if (writer->curseg != NULL)
+	{
+		writer->curseg->full = true;
+		writer->curseg = NULL;
+	}
+
+	/* start all the fsyncs before waiting for any */
+	for (i = 0; i < SEGMENTS_COUNT; i++)
+		advance_segment(writer, &writer->segments[i], false);
+	for (i = 0; i < SEGMENTS_COUNT; i++)
+		advance_segment(writer, &writer->segments[i], true);
+
+	for (i = 0; i < BUFFERS_COUNT; i++)
+		release_buffer(&writer->buffers[i]);
+
+	if (writer->walworkers != NULL)
+		IAWalWorkersStop(writer->walworkers);
 }
 
+/*
+ * Forget a writer whose writes are all done and free its memory.
+ */
+static void
+release_writer(InsertAppendWriter *writer)
+{
+	InsertAppendWriter **prev;
+
+	for (prev = &open_writers; *prev != writer; prev = &(*prev)->next)
+		;
+	*prev = writer->next;
+
+	MemoryContextDelete(writer->mcxt);
+}
+
+/*
+ * Create a writer for the relation of params.  It is released by the
+ * abort callbacks from now on.
+ */
 static InsertAppendWriter *
-CreateDirectWriter(Relation rel)
+alloc_writer(IAWriterParams *params)
 {
-    InsertAppendWriter       *writer;
+	InsertAppendWriter *writer;
+	MemoryContext	mcxt;
+	int				i;
 
-	writer = palloc0(sizeof(InsertAppendWriter));
+	/*
+	 * The buffers may still be read by in flight writes when an error is
+	 * raised, so they can not live in the executor memory: the abort
+	 * callbacks release them once the writes are done.
+	 */
+	mcxt = AllocSetContextCreate(TopMemoryContext,
+								 "direct path writer",
+								 ALLOCSET_DEFAULT_SIZES);
+	writer = MemoryContextAllocZero(mcxt, sizeof(InsertAppendWriter));
+	writer->mcxt = mcxt;
+	writer->subid = GetCurrentSubTransactionId();
+	writer->node = params->node;
+	writer->backend = params->backend;
+	writer->target_free = params->target_free;
+
+	writer->direct_io = ia_direct_io && IA_O_DIRECT != 0 &&
+		BLCKSZ % IA_IO_ALIGN == 0;
+
+	writer->curbuf = 0;
+	writer->pages_target = MIN_PAGES_COUNT;
+	writer->max_pages = (int) Min((double) ia_max_buffer_size * 1024 / BLCKSZ,
+								  (double) RELSEG_SIZE);
+	writer->curblk = 0;
+	writer->blks_initial_cnt = params->blks_initial_cnt;
+	writer->blks_append_cnt = 0;
+	writer->preallocate = ia_preallocate;
+	writer->blks_estimated = params->blks_estimated;
+	writer->prealloc_end = writer->blks_initial_cnt;
+	for (i = 0; i < SEGMENTS_COUNT; i++)
+		writer->segments[i].fd = -1;
+	writer->curseg = NULL;
+	writer->use_wal = params->use_wal;
+	writer->sync_checkpointer = params->sync_checkpointer;
+	writer->wal_buf = -1;
+
+	writer->next = open_writers;
+	open_writers = writer;
+
+	return writer;
+}
+
+/*
+ * Get the buffers of a writer ready for its first page.  With WAL workers,
+ * the buffers live in the segment shared with them.  The next buffer is
+ * only allocated once the first one is full.
+ */
+static void
+start_writer(InsertAppendWriter *writer)
+{
+	Page		page;
+
+	if (writer->use_wal)
+		writer->walworkers = IAWalWorkersStart(writer->node, BUFFERS_COUNT,
+											   (Size) BLCKSZ * writer->max_pages,
+											   writer->mcxt);
+	resize_buffer(writer);
+
+	page = GetCurrentPage(writer);
+	PageInit(page, BLCKSZ, 0);
+	GetCurrentBuffer(writer)->ready_blknos[0] = writer->blks_initial_cnt;
+	GetCurrentBuffer(writer)->ready_pages[0] = page;
+
+	IAThrottleStart();
+}
+
+/*
+ * Create the writer of a direct path insert into rel, the rows being put
+ * on pages by a page builder when pipeline is set and one can be started.
+ * When parallel is set, the blocks are shared with the writers of the
+ * parallel workers.
+ */
+static InsertAppendWriter *
+CreateDirectWriter(Relation rel, Plan *subplan, bool pipeline, bool parallel)
+{
+	InsertAppendWriter *writer;
+	IAWriterParams params;
 
 	/* an access exlusive lock is acquired on the relation */
 #if PG_VERSION_NUM >= PG_VERSION_13
@@ -117,29 +409,230 @@ CreateDirectWriter(Relation rel)
 	heap_open(RelationGetRelid(rel), AccessExclusiveLock);
 #endif
 
+	params.node = rel->rd_node;
+	params.backend = rel->rd_backend;
+	params.blks_initial_cnt = RelationGetNumberOfBlocks(rel);
+	params.blks_estimated = estimate_blocks(subplan);
+	params.target_free = RelationGetTargetPageFreeSpace(rel,
+														HEAP_DEFAULT_FILLFACTOR);
+
+	/*
+	 * The segments of a WAL-logged relation are rebuilt from the full page
+	 * images after a crash, so only the checkpoints need them on disk.
+	 */
+	params.use_wal = IARelationNeedsWAL(rel);
+	params.sync_checkpointer = ia_sync_mode == IA_SYNC_MODE_CHECKPOINTER &&
+		params.use_wal;
+
+	writer = alloc_writer(&params);
 	writer->rel = rel;
-	writer->blocks = palloc(BLCKSZ * PAGES_COUNT);
-	writer->curblk = 0;
-	writer->blks_initial_cnt = RelationGetNumberOfBlocks(rel);
-	writer->blks_append_cnt = 0;
-	writer->datafd = -1;
 	writer->xid = GetCurrentTransactionId();
 	writer->cid = GetCurrentCommandId(true);
 
-    return writer;
+	/*
+	 * The writers reserve their blocks as they flush them, the relation
+	 * files can not be preallocated ahead of the writes.
+	 */
+	if (parallel)
+		writer->parallel = IAParallelBegin(&params, RelationGetRelid(rel),
+										   writer->xid, writer->cid,
+										   writer->mcxt);
+	if (writer->parallel != NULL)
+	{
+		writer->shared_blocks = IAParallelBlocks(writer->parallel);
+		writer->preallocate = false;
+	}
+	else if (pipeline)
+		writer->pipeline = IAPipelineStart(&params, writer->mcxt);
+	if (writer->pipeline == NULL)
+		start_writer(writer);
+
+	/*
+	 * The new pages are only WAL-logged as images, so the rows go in
+	 * logical messages for logical decoding.
+	 */
+	if (ia_logical_messages && RelationIsLogicallyLogged(rel))
+		writer->logical = IALogicalStart(RelationGetRelid(rel), writer->mcxt);
+
+	return writer;
+}
+
+/*
+ * Release the writers left opened by an aborted (sub)transaction.
+ */
+static void
+abort_writers(SubTransactionId subid)
+{
+	InsertAppendWriter **prev = &open_writers;
+
+	while (*prev != NULL)
+	{
+		InsertAppendWriter *writer = *prev;
+		int			i;
+
+		if (subid != InvalidSubTransactionId && writer->subid != subid)
+		{
+			prev = &writer->next;
+			continue;
+		}
+
+		*prev = writer->next;
+
+		if (writer->pipeline != NULL)
+			IAPipelineStop(writer->pipeline);
+
+		if (writer->parallel != NULL)
+			IAParallelEnd(writer->parallel);
+
+		for (i = 0; i < BUFFERS_COUNT; i++)
+		{
+			IAIOCancel(&writer->buffers[i].io);
+			release_buffer(&writer->buffers[i]);
+		}
+
+		if (writer->walworkers != NULL)
+			IAWalWorkersStop(writer->walworkers);
+
+		trim_preallocation(writer, WARNING);
+
+		for (i = 0; i < SEGMENTS_COUNT; i++)
+		{
+			InsertAppendSegment *seg = &writer->segments[i];
+
+			if (seg->fd == -1)
+				continue;
+
+			IAIOCancel(&seg->sync);
+			IAIOForgetWriteback(seg->fd);
+			close(seg->fd);
+		}
+
+		MemoryContextDelete(writer->mcxt);
+	}
+}
+
+void
+IAWriterXactCallback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT || event == XACT_EVENT_PARALLEL_ABORT)
+		abort_writers(InvalidSubTransactionId);
+}
+
+void
+IAWriterSubXactCallback(SubXactEvent event, SubTransactionId mySubid,
+						SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		abort_writers(mySubid);
+}
+
+/*
+ * Number of blocks the rows of plan would fill, from the planner estimates.
+ * Preallocation never goes beyond a segment, so neither does the result.
+ */
+static BlockNumber
+estimate_blocks(Plan *plan)
+{
+	double		tuple_size;
+	double		tuples_per_page;
+	double		blocks;
+
+	tuple_size = MAXALIGN(SizeofHeapTupleHeader + Max(plan->plan_width, 0)) +
+		sizeof(ItemIdData);
+	tuples_per_page = floor((BLCKSZ - SizeOfPageHeaderData) / tuple_size);
+	tuples_per_page = Min(Max(tuples_per_page, 1), MaxHeapTuplesPerPage);
+	blocks = ceil(plan->plan_rows / tuples_per_page);
+
+	return (BlockNumber) Min(Max(blocks, 0), RELSEG_SIZE);
+}
+
+/*
+ * Allocate the disk space of a file range, extending the file if needed.
+ * Returns 0 or an errno value.  posix_fallocate() is only a fallback as the
+ * C library may emulate it by writing zeroes.
+ */
+static int
+allocate_file_range(int fd, off_t offset, off_t len)
+{
+#if defined(__linux__)
+	if (fallocate(fd, 0, offset, len) == 0)
+		return 0;
+	return errno;
+#elif defined(HAVE_POSIX_FALLOCATE)
+	return posix_fallocate(fd, offset, len);
+#else
+	return EOPNOTSUPP;
+#endif
+}
+
+/*
+ * Make sure that the nblocks blocks about to be written from relblks are
+ * allocated, reserving ahead the ones expected next so that the filesystem
+ * lays the segment out in a few large extents: up to the planner estimate,
+ * then twice what has been appended so far, never beyond the segment end.
+ */
+static void
+preallocate_blocks(InsertAppendWriter *writer, BlockNumber relblks, int nblocks)
+{
+	BlockNumber segend = (relblks / RELSEG_SIZE + 1) * RELSEG_SIZE;
+	BlockNumber start = Max(writer->prealloc_end, relblks);
+	BlockNumber target;
+	int			rc;
+
+	if (relblks + nblocks <= writer->prealloc_end)
+		return;
+
+	target = writer->blks_initial_cnt + writer->blks_estimated;
+	if (target < relblks + nblocks)
+		target = relblks + Max(nblocks, writer->blks_append_cnt);
+	target = Min(target, segend);
+
+	rc = allocate_file_range(writer->curseg->fd,
+							 (off_t) BLCKSZ * (start % RELSEG_SIZE),
+							 (off_t) BLCKSZ * (target - start));
+	if (rc != 0)
+	{
+		/* not supported by the filesystem, or no space left: just write */
+		errno = rc;
+		ereport(DEBUG1,
+				(errmsg("could not preallocate file space, writing without preallocation: %m")));
+		writer->preallocate = false;
+		return;
+	}
+
+	writer->prealloc_end = target;
+}
+
+/*
+ * Give back the space preallocated beyond the last written block, so that
+ * the file size matches the relation size.  The writes must be done.
+ */
+static void
+trim_preallocation(InsertAppendWriter *writer, int elevel)
+{
+	BlockNumber relblks = BLKS_TOTAL_CNT(writer);
+
+	if (writer->curseg == NULL || writer->prealloc_end <= relblks)
+		return;
+
+	if (ftruncate(writer->curseg->fd, (off_t) BLCKSZ * (relblks % RELSEG_SIZE)) != 0)
+		ereport(elevel, (errcode_for_file_access(),
+						 errmsg("could not truncate file: %m")));
+
+	writer->prealloc_end = relblks;
 }
 
 static int
-open_relation_file(RelFileNode rnode, bool istemp, BlockNumber blknum)
+open_relation_file(RelFileNode rnode, BackendId backend, BlockNumber blknum,
+				   bool *direct_io)
 {
-	int			ret;
 	BlockNumber segno;
 	char	   *filename = NULL;
 	RelFileNodeBackend	bknode;
 	int			fd = -1;
 
 	bknode.node = rnode;
-	bknode.backend = istemp ? MyBackendId : InvalidBackendId;
+	bknode.backend = backend;
 	filename = relpath(bknode, MAIN_FORKNUM);
 
 	segno = blknum / RELSEG_SIZE;
@@ -153,133 +646,628 @@ open_relation_file(RelFileNode rnode, bool istemp, BlockNumber blknum)
 		filename = tmpf;
 	}
 #if PG_VERSION_NUM >= PG_VERSION_11
-	fd = BasicOpenFilePerm(filename, O_CREAT | O_WRONLY | PG_BINARY, S_IRUSR | S_IWUSR);
+	fd = BasicOpenFilePerm(filename, O_CREAT | O_WRONLY | PG_BINARY |
+						   (*direct_io ? IA_O_DIRECT : 0), S_IRUSR | S_IWUSR);
 #else
-	fd = BasicOpenFile(filename, O_CREAT | O_WRONLY | PG_BINARY, S_IRUSR | S_IWUSR);
+	fd = BasicOpenFile(filename, O_CREAT | O_WRONLY | PG_BINARY |
+					   (*direct_io ? IA_O_DIRECT : 0), S_IRUSR | S_IWUSR);
 #endif
+
+	/* the filesystem does not support direct I/O, fall back to buffered I/O */
+	if (fd == -1 && errno == EINVAL && *direct_io)
+	{
+		ereport(LOG,
+				(errmsg("could not open file \"%s\" for direct I/O, using buffered I/O instead",
+						filename)));
+		*direct_io = false;
+#if PG_VERSION_NUM >= PG_VERSION_11
+		fd = BasicOpenFilePerm(filename, O_CREAT | O_WRONLY | PG_BINARY, S_IRUSR | S_IWUSR);
+#else
+		fd = BasicOpenFile(filename, O_CREAT | O_WRONLY | PG_BINARY, S_IRUSR | S_IWUSR);
+#endif
+	}
+
 	if (fd == -1)
 		ereport(ERROR, (errcode_for_file_access(),
 						errmsg("could not open file: %m")));
 
-	ret = lseek(fd, BLCKSZ * (blknum % RELSEG_SIZE), SEEK_SET);
+	pfree(filename);
+
+	return fd;
+}
+
+/*
+ * Hand the fsync of a segment over to the checkpointer, the way smgr does
+ * for the buffered writes.  A checkpoint whose redo pointer was computed
+ * since the segment was opened may be past some of its WAL records and
+ * already done with the sync requests, so the segment is then not
+ * registered.  Returns false when the caller has to fsync it.
+ */
+static bool
+register_segment_sync(InsertAppendWriter *writer, BlockNumber segno,
+					  XLogRecPtr redo)
+{
+	bool		registered = false;
+
+	/*
+	 * Do not wait for room in the request queue here: the checkpointer may
+	 * itself be waiting for the delay to end.
+	 */
+	IADelayCheckpoint();
 
-	if (ret == -1)
+	if (redo == GetRedoRecPtr())
 	{
-		close(fd);
-		ereport(ERROR, (errcode_for_file_access(),
-						errmsg
-						("could not seek the end of file: %m")));
+#if PG_VERSION_NUM >= PG_VERSION_12
+		FileTag		tag;
+
+		MemSet(&tag, 0, sizeof(FileTag));
+		tag.handler = SYNC_HANDLER_MD;
+		tag.forknum = MAIN_FORKNUM;
+		tag.rnode = writer->node;
+		tag.segno = segno;
+
+		registered = RegisterSyncRequest(&tag, SYNC_REQUEST, false);
+#else
+		registered = ForwardFsyncRequest(writer->node, MAIN_FORKNUM,
+										 segno);
+#endif
 	}
 
-	pfree(filename);
+	IAResumeCheckpoint();
 
-	return fd;
+	return registered;
 }
 
+/*
+ * Get a slot for the file of the segment of block relblks and open it.
+ * When all the slots are taken, the oldest filled up file is synced and
+ * closed first.  redo is the redo pointer from before any WAL record for
+ * the pages to be written to the file.
+ */
+static InsertAppendSegment *
+open_segment(InsertAppendWriter *writer, BlockNumber relblks, XLogRecPtr redo)
+{
+	InsertAppendSegment *seg;
+	int			i;
+
+	for (;;)
+	{
+		InsertAppendSegment *oldest = NULL;
+
+		seg = NULL;
+		for (i = 0; i < SEGMENTS_COUNT; i++)
+		{
+			if (writer->segments[i].fd == -1)
+			{
+				seg = &writer->segments[i];
+				break;
+			}
+			if (oldest == NULL || writer->segments[i].segno < oldest->segno)
+				oldest = &writer->segments[i];
+		}
+
+		if (seg != NULL)
+			break;
+
+		wait_buffers(writer);
+		advance_segment(writer, oldest, true);
+	}
+
+	seg->redo = redo;
+	seg->segno = relblks / RELSEG_SIZE;
+	seg->full = false;
+	seg->last_buf = -1;
+	seg->syncing = false;
+	seg->sync.count = 0;
+	seg->fd = open_relation_file(writer->node, writer->backend,
+								 relblks, &writer->direct_io);
+
+	return seg;
+}
+
+/*
+ * Move a filled up file forward: once its writes are done, hand its fsync
+ * over to the checkpointer or start it, then close the file once the fsync
+ * is done.  With wait, block until the file is closed; its writes must be
+ * done.
+ */
 static void
-close_relation_file(InsertAppendWriter *writer)
+advance_segment(InsertAppendWriter *writer, InsertAppendSegment *seg,
+				bool wait)
 {
-	if (writer->datafd != -1)
+	if (seg->fd == -1 || !seg->full || seg->last_buf != -1)
+		return;
+
+	if (!seg->syncing)
 	{
-		if (pg_fsync(writer->datafd) != 0)
-			ereport(WARNING, (errcode_for_file_access(),
-						errmsg("could not sync file: %m")));
-		if (close(writer->datafd) < 0)
-			ereport(WARNING, (errcode_for_file_access(),
-						errmsg("could not close file: %m")));
-		writer->datafd = -1;
+		IAIOForgetWriteback(seg->fd);
+		seg->syncing = true;
+		if (!writer->sync_checkpointer ||
+			!register_segment_sync(writer, seg->segno, seg->redo))
+			IAIOFsync(&seg->sync, seg->fd);
 	}
+
+	if (!wait && !IAIOPoll(&seg->sync))
+		return;
+
+	IAIOWait(&seg->sync);
+
+	if (close(seg->fd) < 0)
+		ereport(WARNING, (errcode_for_file_access(),
+					errmsg("could not close file: %m")));
+	seg->fd = -1;
 }
 
+/*
+ * Wait for the writes of a buffer to be done.  The files filled up are done
+ * with once the last buffer that wrote to them is.
+ */
 static void
-flush_pages(InsertAppendWriter *writer)
+wait_buffer(InsertAppendWriter *writer, int buf)
 {
 	int			i;
-	int			num;
 
-	num = writer->curblk;
-	if (!PageIsEmpty(GetCurrentPage(writer)))
-		num += 1;
+	IAIOWait(&writer->buffers[buf].io);
 
-	if (num <= 0)
+	for (i = 0; i < SEGMENTS_COUNT; i++)
+	{
+		InsertAppendSegment *seg = &writer->segments[i];
+
+		if (seg->fd != -1 && seg->full && seg->last_buf == buf)
+			seg->last_buf = -1;
+	}
+}
+
+/*
+ * Wait for the writes of all the buffers to be done.
+ */
+static void
+wait_buffers(InsertAppendWriter *writer)
+{
+	int			i;
+
+	for (i = 0; i < BUFFERS_COUNT; i++)
+		wait_buffer(writer, i);
+}
+
+/*
+ * Allocate room for nblocks blocks in a buffer, replacing its previous
+ * allocation.  The blocks come from the buffer pool, or from the segment
+ * shared with the WAL workers, page aligned as needed by direct I/O: block
+ * offsets and write sizes are multiples of BLCKSZ.  Returns false when out
+ * of memory.
+ */
+static bool
+alloc_buffer(InsertAppendWriter *writer, InsertAppendBuffer *buffer,
+			 int nblocks)
+{
+	char	   *blocks;
+	Size		blocks_size = 0;
+	char	   *arrays;
+
+	if (writer->walworkers != NULL)
+		blocks = IAWalWorkersBuffer(writer->walworkers,
+									buffer - writer->buffers);
+	else
+	{
+		blocks = IABufferGet((Size) BLCKSZ * nblocks, &blocks_size);
+		if (blocks == NULL)
+			return false;
+	}
+
+	arrays = MemoryContextAllocExtended(writer->mcxt,
+										(Size) nblocks * (sizeof(Page) + sizeof(BlockNumber)),
+										MCXT_ALLOC_NO_OOM);
+	if (arrays == NULL)
+	{
+		if (blocks_size > 0)
+			IABufferRelease(blocks, blocks_size);
+		return false;
+	}
+
+	release_buffer(buffer);
+
+	buffer->blocks = blocks;
+	buffer->blocks_size = blocks_size;
+	buffer->nblocks = nblocks;
+	buffer->ready_pages = (Page *) arrays;
+	buffer->ready_blknos = (BlockNumber *) (arrays + (Size) nblocks * sizeof(Page));
+
+	return true;
+}
+
+/*
+ * Give the blocks of a buffer back to the pool.  Its writes must be done.
+ */
+static void
+release_buffer(InsertAppendBuffer *buffer)
+{
+	if (buffer->blocks == NULL)
 		return;
 
-	/*
-	 * Write pages.
-	 */
+	if (buffer->blocks_size > 0)
+		IABufferRelease(buffer->blocks, buffer->blocks_size);
+	pfree(buffer->ready_pages);
+	buffer->blocks = NULL;
+	buffer->ready_pages = NULL;
+	buffer->ready_blknos = NULL;
+	buffer->nblocks = 0;
+}
+
+/*
+ * Bring the capacity of the current buffer, whose writes are done, to the
+ * writer target.  When memory is tight the target is halved until the
+ * allocation succeeds, a buffer larger than the target being given back
+ * before allocating the smaller one.
+ */
+static void
+resize_buffer(InsertAppendWriter *writer)
+{
+	InsertAppendBuffer *buffer = GetCurrentBuffer(writer);
+
+	while (buffer->nblocks != writer->pages_target)
+	{
+		if (buffer->nblocks > writer->pages_target)
+			release_buffer(buffer);
+
+		if (alloc_buffer(writer, buffer, writer->pages_target))
+			break;
+
+		if (writer->pages_target <= MIN_PAGES_COUNT)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of memory"),
+					 errdetail("Failed to allocate a direct path buffer of %d blocks.",
+							   writer->pages_target)));
+
+		writer->pages_target = Max(writer->pages_target / 2, MIN_PAGES_COUNT);
+	}
+}
+
+/*
+ * Queue the positional writes of the num first blocks of a buffer, one per
+ * segment file they go to.
+ */
+static void
+write_blocks(InsertAppendWriter *writer, InsertAppendBuffer *buffer, int num,
+			 XLogRecPtr redo)
+{
+	int			i;
+
 	for (i = 0; i < num;)
 	{
-		char	   *buffer;
-		int			total;
-		int			written;
 		int			flush_num;
-		BlockNumber	relblks = BLKS_TOTAL_CNT(writer);
+		BlockNumber	relblks = buffer->ready_blknos[0] + i;
 
-		/* switch to the next file if the current file has been filled up */
-		if (relblks % RELSEG_SIZE == 0)
-			close_relation_file(writer);
+		/*
+		 * Switch to the next file if the current file has been filled up,
+		 * or to the file of the blocks reserved by a parallel writer.  The
+		 * writes to the previous file are left in flight along with
+		 * the ones to the new file; it is synced and closed once they are
+		 * done.
+		 */
+		if (writer->curseg != NULL &&
+			writer->curseg->segno != relblks / RELSEG_SIZE)
+		{
+			writer->curseg->full = true;
+			writer->curseg->last_buf = buffer - writer->buffers;
+			writer->curseg = NULL;
+		}
 
-		if (writer->datafd == -1)
-			writer->datafd = open_relation_file(writer->rel->rd_node,
-											RELATION_IS_LOCAL(writer->rel),
-											relblks);
+		if (writer->curseg == NULL)
+			writer->curseg = open_segment(writer, relblks, redo);
 
 		/* number of blocks to be added to the current file */
 		flush_num = Min(num - i, RELSEG_SIZE - relblks % RELSEG_SIZE);
 
 		Assert(flush_num > 0);
 
+		if (writer->preallocate)
+			preallocate_blocks(writer, relblks, flush_num);
+
+		IAIOWrite(&buffer->io, writer->curseg->fd,
+				  buffer->blocks + (Size) BLCKSZ * i, (Size) BLCKSZ * flush_num,
+				  (off_t) BLCKSZ * (relblks % RELSEG_SIZE));
+
+		i += flush_num;
+	}
+}
+
+/*
+ * Queue the writes of the pages handed over to the WAL workers, once they
+ * are done with them: the pages then hold their LSN and checksum.  Returns
+ * the number of WAL bytes written for them.
+ */
+static uint64
+write_logged_pages(InsertAppendWriter *writer)
+{
+	InsertAppendBuffer *buffer;
+	uint64		wal_bytes;
+
+	if (writer->wal_buf == -1)
+		return 0;
+
+	buffer = &writer->buffers[writer->wal_buf];
+	wal_bytes = IAWalWorkersWait(writer->walworkers);
+	write_blocks(writer, buffer, buffer->wal_num, buffer->wal_redo);
+	writer->wal_buf = -1;
+
+	return wal_bytes;
+}
+
+/*
+ * Queue the writes of the pages handed over to the WAL workers as soon as
+ * they are done with them, while the next buffer is being filled: these
+ * writes are then usually done by the time the buffer is needed again.
+ */
+static void
+poll_logged_pages(InsertAppendWriter *writer)
+{
+	if (writer->wal_buf == -1 || !IAWalWorkersDone(writer->walworkers))
+		return;
+
+	writer->wal_bytes += write_logged_pages(writer);
+}
+
+/*
+ * WAL log and checksum the pages of the current buffer, queue their writes
+ * and move on to the next buffer.
+ */
+static void
+flush_pages(InsertAppendWriter *writer)
+{
+	InsertAppendBuffer *buffer = GetCurrentBuffer(writer);
+	XLogRecPtr	redo;
+	uint64		wal_bytes = 0;
+	int			i;
+	int			num;
+
+	num = writer->curblk;
+	if (!PageIsEmpty(GetCurrentPage(writer)))
+		num += 1;
+
+	if (num <= 0)
+		return;
+
+	if (writer->logical != NULL)
+		IALogicalFlush(writer->logical);
+
+	IAIOReap();
+
+	if (writer->shared_blocks != NULL)
+		reserve_blocks(writer, buffer, num);
+
+	/* before any WAL record for the pages, see register_segment_sync() */
+	redo = GetRedoRecPtr();
+
+	/* the next pages follow these ones, whenever they are written */
+	writer->blks_append_cnt += num;
+
+	if (writer->walworkers != NULL)
+	{
 		/*
-		 * If the relation is a logged one then write the new pages
-		 * in the WAL files.
+		 * The workers WAL-log and checksum the pages while the next buffer
+		 * is filled.  The pages of the previous buffer are written first,
+		 * once the workers are done with them, if that was not done while
+		 * filling this one.
 		 */
-		if (!RELATION_IS_LOCAL(writer->rel)
-			&& !(writer->rel->rd_rel->relpersistence == RELPERSISTENCE_UNLOGGED))
-		{
-			log_newpages(&writer->rel->rd_node, MAIN_FORKNUM, flush_num,
-							writer->ready_blknos, writer->ready_pages, true);
-		}
+		wal_bytes = writer->wal_bytes + write_logged_pages(writer);
+		writer->wal_bytes = 0;
+		buffer->wal_num = num;
+		buffer->wal_redo = redo;
+		IAWalWorkersLog(writer->walworkers, writer->curbuf, num,
+						buffer->ready_blknos[0]);
+		writer->wal_buf = writer->curbuf;
+	}
+	else
+	{
+		/*
+		 * If the relation needs WAL then write the new pages in the WAL
+		 * files.
+		 */
+		if (writer->use_wal)
+			wal_bytes = IAXLogNewPages(&writer->node, MAIN_FORKNUM,
+									   num, buffer->ready_blknos,
+									   buffer->ready_pages);
 
 		if (DataChecksumsEnabled())
 		{
-			int		j;
-			/*
-			 * Write checksum for pages that are going to be written to the
-			 * current file.
-			 */
-			for (j = 0; j < flush_num; j++)
-				PageSetChecksumInplace(writer->ready_pages[j], writer->ready_blknos[j]);
-		}	
-
-		writer->blks_append_cnt += flush_num;
+			for (i = 0; i < num; i++)
+				PageSetChecksumInplace(buffer->ready_pages[i], buffer->ready_blknos[i]);
+		}
 
 		/*
-		 * Write flush_num blocks to the current file starting at block
-		 * offset i.  The current file might get full, ie, RELSEG_SIZE blocks
-		 * full, after writing that much (see how flush_num is calculated
-		 * above to understand why). We write the remaining content of the
-		 * block buffer in the new file during the next iteration.
+		 * The pages are contiguous in the buffer, so each segment file gets
+		 * a single write.
 		 */
+		write_blocks(writer, buffer, num, redo);
+	}
 
-		buffer = writer->blocks + BLCKSZ * i;
-		total = BLCKSZ * flush_num;
-		written = 0;
+	/* a full buffer means a large load, write it by larger chunks */
+	if (num == buffer->nblocks)
+		writer->pages_target = Max(Min(writer->pages_target * 2,
+									   writer->max_pages),
+								   MIN_PAGES_COUNT);
 
-		while (total > 0)
+	/*
+	 * Fill the next buffer while this one is being written.  Its own writes
+	 * were queued one buffer fill ago so they are usually done by now.
+	 */
+	writer->curbuf = (writer->curbuf + 1) % BUFFERS_COUNT;
+	wait_buffer(writer, writer->curbuf);
+	resize_buffer(writer);
+
+	for (i = 0; i < SEGMENTS_COUNT; i++)
+		advance_segment(writer, &writer->segments[i], false);
+
+	IAThrottle(wal_bytes, (uint64) BLCKSZ * num);
+}
+
+/*
+ * Put a tuple, its header complete but for its ctid, on the current page or
+ * on the next one if it does not fit.  Its position is returned in tid.
+ */
+static void
+add_tuple(InsertAppendWriter *writer, Item item, uint32 len, ItemPointer tid)
+{
+	Page		page = GetCurrentPage(writer);
+	OffsetNumber offnum;
+
+	if (PageGetFreeSpace(page) < MAXALIGN(len) + writer->target_free)
+	{
+		if (writer->curblk < GetCurrentBuffer(writer)->nblocks - 1)
 		{
-			int	len = write(writer->datafd, buffer + written, total);
-			if (len == -1)
-			{
-				/* fatal error, do not want to write blocks anymore */
-				ereport(ERROR, (errcode_for_file_access(),
-								errmsg("could not write to file: %m")));
-			}
-			written += len;
-			total -= len;
+			writer->curblk++;
+			poll_logged_pages(writer);
+		}
+		else
+		{
+			flush_pages(writer);
+			writer->curblk = 0;	/* recycle from first block */
 		}
 
-		i += flush_num;
+		page = GetCurrentPage(writer);
+
+		/* initialize current block */
+		PageInit(page, BLCKSZ, 0);
+		GetCurrentBuffer(writer)->ready_blknos[writer->curblk] = writer->blks_initial_cnt + writer->blks_append_cnt + writer->curblk;
+		GetCurrentBuffer(writer)->ready_pages[writer->curblk] = page;
+	}
+
+	/* put the tuple on local page */
+	offnum = PageAddItem(page, item, len, InvalidOffsetNumber, false, true);
+
+	ItemPointerSet(tid, BLKS_TOTAL_CNT(writer) + writer->curblk, offnum);
+	((HeapTupleHeader) PageGetItem(page, PageGetItemId(page, offnum)))->t_ctid = *tid;
+}
+
+/*
+ * Move the num first pages of a buffer to blocks reserved from the counter
+ * shared by the writers of a parallel insert.  The pages were numbered as
+ * if they followed the previous ones, so the ctid of their tuples is fixed
+ * up too.
+ */
+static void
+reserve_blocks(InsertAppendWriter *writer, InsertAppendBuffer *buffer, int num)
+{
+	BlockNumber	start = pg_atomic_fetch_add_u32(writer->shared_blocks, num);
+	int			i;
+
+	for (i = 0; i < num; i++)
+	{
+		Page		page = buffer->ready_pages[i];
+		OffsetNumber maxoff = PageGetMaxOffsetNumber(page);
+		OffsetNumber offnum;
+
+		buffer->ready_blknos[i] = start + i;
+
+		for (offnum = FirstOffsetNumber; offnum <= maxoff; offnum++)
+		{
+			ItemId		itemid = PageGetItemId(page, offnum);
+
+			if (ItemIdIsNormal(itemid))
+				ItemPointerSetBlockNumber(&((HeapTupleHeader) PageGetItem(page, itemid))->t_ctid,
+										  start + i);
+		}
+	}
+}
+
+/*
+ * Set the transaction fields of a tuple header for the writer.
+ */
+static void
+stamp_tuple(InsertAppendWriter *writer, HeapTuple tuple)
+{
+	tuple->t_data->t_infomask &= ~(HEAP_XACT_MASK);
+	tuple->t_data->t_infomask2 &= ~(HEAP2_XACT_MASK);
+	tuple->t_data->t_infomask |= HEAP_XMAX_INVALID;
+	HeapTupleHeaderSetXmin(tuple->t_data, writer->xid);
+	HeapTupleHeaderSetCmin(tuple->t_data, writer->cid);
+	HeapTupleHeaderSetXmax(tuple->t_data, 0);
+}
+
+/*
+ * Open the writer of a parallel worker, for the insert of the transaction
+ * xid the leader runs, its blocks being reserved from shared_blocks.
+ */
+InsertAppendWriter *
+IAWriterOpen(IAWriterParams *params, TransactionId xid, CommandId cid,
+			 pg_atomic_uint32 *shared_blocks)
+{
+	InsertAppendWriter *writer = alloc_writer(params);
+
+	writer->xid = xid;
+	writer->cid = cid;
+	writer->shared_blocks = shared_blocks;
+	writer->preallocate = false;
+	start_writer(writer);
+
+	return writer;
+}
+
+/*
+ * Put a tuple, neither toasted nor needing to be, on the pages of a
+ * parallel worker writer.
+ */
+void
+IAWriterInsert(InsertAppendWriter *writer, HeapTuple tuple)
+{
+	stamp_tuple(writer, tuple);
+	add_tuple(writer, (Item) tuple->t_data, tuple->t_len, &tuple->t_self);
+}
+
+/*
+ * Write the last pages of a parallel worker writer and release it.
+ */
+void
+IAWriterClose(InsertAppendWriter *writer)
+{
+	finish_writer(writer);
+	release_writer(writer);
+}
+
+/*
+ * Entry point of the page builder of a pipelined direct path insert: put
+ * the rows sent by the leader on pages and write them, as the leader does
+ * without pipeline.
+ */
+void
+IAPipelineWorkerMain(Datum main_arg)
+{
+	IAPipeline *pipe;
+	IAWriterParams params;
+	InsertAppendWriter *writer;
+	Item		item;
+	uint32		len;
+	ItemPointerData tid;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	/* no database is needed to write the relation files */
+#if PG_VERSION_NUM >= PG_VERSION_11
+	BackgroundWorkerInitializeConnectionByOid(InvalidOid, InvalidOid, 0);
+#else
+	BackgroundWorkerInitializeConnectionByOid(InvalidOid, InvalidOid);
+#endif
+
+	pipe = IAPipelineAttach(main_arg, &params);
+	if (pipe == NULL)
+		proc_exit(0);			/* the leader is already done */
+
+	writer = alloc_writer(&params);
+	start_writer(writer);
+
+	while (IAPipelineReceive(pipe, &item, &len))
+	{
+		CHECK_FOR_INTERRUPTS();
+		add_tuple(writer, item, len, &tid);
 	}
+
+	finish_writer(writer);
+	IAPipelineDone(pipe, writer->blks_append_cnt);
+
+	proc_exit(0);
 }
 
 /*
@@ -295,15 +1283,10 @@ IAExecInsert(ModifyTableState *mtstate,
 		   bool canSetTag,
 		   InsertAppendWriter *writer)
 {
-	Page           page;
-	OffsetNumber    offnum;
-    ItemId          itemId;
-    Item            item;
 	HeapTuple  tuple;
+	HeapTuple	rowtuple;
 	MemoryContext       query_mcxt = CurrentMemoryContext;
 
-	page = GetCurrentPage(writer);
-
 #if PG_VERSION_NUM >= PG_VERSION_12
 	tuple = ExecFetchSlotHeapTuple(slot, false, NULL);
 #else
@@ -326,8 +1309,14 @@ IAExecInsert(ModifyTableState *mtstate,
 			return NULL;		/* "do nothing" */
 	}
 
-    /* take care of toasted data if needed */
-	if (tuple->t_len > TOAST_TUPLE_THRESHOLD)
+	/* before toasting, for the logical messages */
+	rowtuple = tuple;
+
+    /*
+	 * take care of toasted data if needed, external values pointing to the
+	 * toast relation of another relation being copied
+	 */
+	if (HeapTupleHasExternal(tuple) || tuple->t_len > TOAST_TUPLE_THRESHOLD)
 #if PG_VERSION_NUM >= PG_VERSION_13
         tuple = heap_toast_insert_or_update(writer->rel, tuple, NULL, 0);
 #else
@@ -351,43 +1340,27 @@ IAExecInsert(ModifyTableState *mtstate,
 						(unsigned long) tuple->t_len,
 						(unsigned long) MaxHeapTupleSize)));
 
-	if (PageGetFreeSpace(page) < MAXALIGN(tuple->t_len) +
-		RelationGetTargetPageFreeSpace(writer->rel, HEAP_DEFAULT_FILLFACTOR))
-	{
-		if (writer->curblk < PAGES_COUNT - 1)
-			writer->curblk++;
-		else
-		{
-			flush_pages(writer);
-			writer->curblk = 0;	/* recycle from first block */
-		}
+	stamp_tuple(writer, tuple);
 
-		page = GetCurrentPage(writer);
+	/*
+	 * The page builder puts the tuple on a page, its position is not known
+	 * here: there are no AFTER ROW triggers to need it then.
+	 */
+	if (writer->pipeline != NULL)
+		IAPipelineSend(writer->pipeline, (Item) tuple->t_data, tuple->t_len);
+	else
+		add_tuple(writer, (Item) tuple->t_data, tuple->t_len,
+				  &tuple->t_self);
 
-		/* initialize current block */
-		PageInit(page, BLCKSZ, 0);
-		writer->ready_blknos[writer->curblk] = writer->blks_initial_cnt + writer->blks_append_cnt + writer->curblk;
-		writer->ready_pages[writer->curblk] = page;
-	}
+	if (writer->spool != NULL)
+		IAIndexSpoolAdd(writer->spool, rowtuple, &tuple->t_self);
 
 	/* Switch to per tuple memory context */
     MemoryContextSwitchTo(GetPerTupleMemoryContext(estate));
 
-	tuple->t_data->t_infomask &= ~(HEAP_XACT_MASK);
-	tuple->t_data->t_infomask2 &= ~(HEAP2_XACT_MASK);
-	tuple->t_data->t_infomask |= HEAP_XMAX_INVALID;
-	HeapTupleHeaderSetXmin(tuple->t_data, writer->xid);
-	HeapTupleHeaderSetCmin(tuple->t_data, writer->cid);
-	HeapTupleHeaderSetXmax(tuple->t_data, 0);
-	
-	/* put the tuple on local page */
-	offnum = PageAddItem(page, (Item) tuple->t_data,
-		tuple->t_len, InvalidOffsetNumber, false, true);
-
-	ItemPointerSet(&(tuple->t_self), BLKS_TOTAL_CNT(writer) + writer->curblk, offnum);
-	itemId = PageGetItemId(page, offnum);
-	item = PageGetItem(page, itemId);
-	((HeapTupleHeader) item)->t_ctid = tuple->t_self;
+	if (writer->logical != NULL)
+		IALogicalAddRow(writer->logical, rowtuple,
+						RelationGetDescr(writer->rel));
 
 	if (canSetTag)
 		(estate->es_processed)++;
@@ -407,10 +1380,14 @@ IAExecInsert(ModifyTableState *mtstate,
 }
 
 /*
- * Modified version of PostgreSQL core ExecModifyTable().
+ * Modified version of PostgreSQL core ExecModifyTable().  When source_plan
+ * is set, the rows come from it rather than from the subplan, the source
+ * query running in parallel while the rows are stored by the leader: with
+ * nworkers, the workers store most of the rows themselves.
  */
 TupleTableSlot *
-ExecInsertAppendTable(PlanState *pstate)
+ExecInsertAppendTable(PlanState *pstate, PlannedStmt *source_plan,
+					  int nworkers)
 {
 	ModifyTableState *node = castNode(ModifyTableState, pstate);
 	EState	   *estate = node->ps.state;
@@ -424,7 +1401,8 @@ ExecInsertAppendTable(PlanState *pstate)
 	TupleTableSlot *slot;
 	TupleTableSlot *planSlot;
 	InsertAppendWriter *writer;
-	Page page;
+	IASource   *source = NULL;
+	bool		pipeline;
 
 	CHECK_FOR_INTERRUPTS();
 
@@ -488,11 +1466,51 @@ ExecInsertAppendTable(PlanState *pstate)
 	 * for each row.
 	 */
 
-	writer = CreateDirectWriter(resultRelInfo->ri_RelationDesc);
-	page = GetCurrentPage(writer);
-	PageInit(page, BLCKSZ, 0);
-	writer->ready_blknos[0] = writer->blks_initial_cnt;
-	writer->ready_pages[0] = page;
+	/* the AFTER ROW triggers need the position of the rows */
+	pipeline = ia_pipeline && node->mt_transition_capture == NULL &&
+		(resultRelInfo->ri_TrigDesc == NULL ||
+		 !resultRelInfo->ri_TrigDesc->trig_insert_after_row);
+
+	/*
+	 * The row triggers could not write while the source query runs in
+	 * parallel mode: it is then run serially, as part of the insert plan.
+	 */
+	if (source_plan != NULL &&
+		(node->mt_transition_capture != NULL ||
+		 (resultRelInfo->ri_TrigDesc != NULL &&
+		  (resultRelInfo->ri_TrigDesc->trig_insert_before_row ||
+		   resultRelInfo->ri_TrigDesc->trig_insert_after_row))))
+		source_plan = NULL;
+
+	/*
+	 * The workers store their rows without the logical messages: they then
+	 * send them to the leader, as when its writer is not shared.
+	 */
+	if (ia_logical_messages &&
+		RelationIsLogicallyLogged(resultRelInfo->ri_RelationDesc))
+		nworkers = 0;
+
+	writer = CreateDirectWriter(resultRelInfo->ri_RelationDesc,
+								subplanstate->plan, pipeline,
+								source_plan != NULL && nworkers > 0);
+
+	/*
+	 * Into an empty relation, the B-tree keys are gathered as the rows are
+	 * stored, rather than read back once it is loaded.  This needs the
+	 * position of every row, which the page builder and the parallel
+	 * workers do not give.  The indexes only get the files built from the
+	 * keys at the end of the load, whatever reads them meanwhile.
+	 */
+	if (writer->blks_initial_cnt == 0 && writer->pipeline == NULL &&
+		writer->parallel == NULL)
+		writer->spool = IAIndexSpoolStart(writer->rel);
+
+	/*
+	 * The writer got the transaction id and command id, which can not be
+	 * assigned in parallel mode: the source query may now enter it.
+	 */
+	if (source_plan != NULL)
+		source = IASourceStart(source_plan, estate);
 
 	for (;;)
 	{
@@ -513,7 +1531,10 @@ ExecInsertAppendTable(PlanState *pstate)
 			ResetExprContext(pstate->ps_ExprContext);
 #endif
 
-		planSlot = ExecProcNode(subplanstate);
+		if (source != NULL)
+			planSlot = IASourceNext(source);
+		else
+			planSlot = ExecProcNode(subplanstate);
 
 #if PG_VERSION_NUM < PG_VERSION_14
 		if (TupIsNull(planSlot))
@@ -629,6 +1650,13 @@ ExecInsertAppendTable(PlanState *pstate)
 
 	}
 
+	if (source != NULL)
+		IASourceEnd(source);
+
+	/* the rows stored by the workers */
+	if (writer->parallel != NULL && node->canSetTag)
+		estate->es_processed += IAParallelProcessed(writer->parallel);
+
 	DirectWriterClose(writer, resultRelInfo);
 
 #if PG_VERSION_NUM < PG_VERSION_14
@@ -652,60 +1680,3 @@ ExecEndInsertAppendTable(PlanState *pstate)
 	ModifyTableState *node = castNode(ModifyTableState, pstate);
 	ExecEndModifyTable(node);
 }
-
-/*
- * Copy of PostgreSQL 14 core log_newpages()
- */
-#if PG_VERSION_NUM < PG_VERSION_14
-static void
-log_newpages(RelFileNode *rnode, ForkNumber forkNum, int num_pages,
-             BlockNumber *blknos, Page *pages, bool page_std)
-{
-    int         flags;
-    XLogRecPtr  recptr;
-    int         i;
-    int         j;
-
-    flags = REGBUF_FORCE_IMAGE;
-    if (page_std)
-        flags |= REGBUF_STANDARD;
-
-    /*
-     * Iterate over all the pages. They are collected into batches of
-     * XLR_MAX_BLOCK_ID pages, and a single WAL-record is written for each
-     * batch.
-     */
-    XLogEnsureRecordSpace(XLR_MAX_BLOCK_ID - 1, 0);
-
-    i = 0;
-    while (i < num_pages)
-    {
-        int         batch_start = i;
-        int         nbatch;
-
-        XLogBeginInsert();
-
-        nbatch = 0;
-        while (nbatch < XLR_MAX_BLOCK_ID && i < num_pages)
-        {
-            XLogRegisterBlock(nbatch, rnode, forkNum, blknos[i], pages[i], flags);
-            i++;
-            nbatch++;
-        }
-
-        recptr = XLogInsert(RM_XLOG_ID, XLOG_FPI);
-
-        for (j = batch_start; j < i; j++)
-        {
-            /*
-             * The page may be uninitialized. If so, we can't set the LSN
-             * because that would corrupt the page.
-             */
-            if (!PageIsNew(pages[j]))
-            {
-                PageSetLSN(pages[j], recptr);
-            }
-        }
-    }
-}
-#endif
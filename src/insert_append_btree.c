@@ -0,0 +1,577 @@
+/*
+ *  insert_append_btree.c
+ *
+ *      This file is part of the pg_directpaths module.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2022: Bertrand Drouvot
+ *
+ */
+
+#include "include/pg_directpaths.h"
+
+#if PG_VERSION_NUM >= PG_VERSION_12
+
+#include "access/htup_details.h"
+#include "access/nbtree.h"
+#include "access/table.h"
+#include "access/xlog.h"
+#include "access/xloginsert.h"
+#include "catalog/catalog.h"
+#include "catalog/indexing.h"
+#include "catalog/pg_class.h"
+#include "catalog/storage.h"
+#include "miscadmin.h"
+#include "storage/bufpage.h"
+#include "storage/smgr.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
+#include "utils/syscache.h"
+#include "include/insert_append_btree.h"
+
+/*
+ * B-tree load from index tuples coming in key order, adapted from
+ * PostgreSQL core nbtsort.c: the pages of each level are filled from left
+ * to right, a full page being written out of the shared buffers and its
+ * downlink added to the level above.  The tuples are not deduplicated.
+ *
+ * The pages go to a file of their own, which only becomes the file of the
+ * index once the load is done: until then, whatever reads the index, as a
+ * trigger on the relation being loaded, reads it as it was, through the
+ * shared buffers.
+ */
+
+#if PG_VERSION_NUM >= PG_VERSION_14
+#define BTPageSetLevel(opaque, lvl)	((opaque)->btpo_level = (lvl))
+#else
+#define BTPageSetLevel(opaque, lvl)	((opaque)->btpo.level = (lvl))
+#endif
+
+/* the loaded indexes belong to permanent relations */
+#define LoaderSmgr(loader)	smgropen((loader)->node, InvalidBackendId)
+
+#if PG_VERSION_NUM >= PG_VERSION_13
+#define BTreeTupleSetNAttsCompat(itup, n)	BTreeTupleSetNAtts((itup), (n), false)
+#define BTreeTupleSetDownLinkCompat(itup, blkno) \
+	BTreeTupleSetDownLink((itup), (blkno))
+#define BTTargetFreeSpace(rel)	BTGetTargetPageFreeSpace(rel)
+#else
+#define BTreeTupleSetNAttsCompat(itup, n)	BTreeTupleSetNAtts((itup), (n))
+#define BTreeTupleSetDownLinkCompat(itup, blkno) \
+	BTreeInnerTupleSetDownLink((itup), (blkno))
+#define BTTargetFreeSpace(rel) \
+	RelationGetTargetPageFreeSpace((rel), BTREE_DEFAULT_FILLFACTOR)
+#endif
+
+/*
+ * Page being filled on one level of the tree.
+ */
+typedef struct IABtreeLevel
+{
+	Page		page;
+	BlockNumber blkno;		/* where the page goes */
+	IndexTuple	lowkey;		/* strict lower bound of the page */
+	OffsetNumber lastoff;	/* last item added */
+	uint32		level;		/* 0 for the leaves */
+	Size		full;		/* page full below that free space */
+	struct IABtreeLevel *next;	/* level above, NULL if none yet */
+} IABtreeLevel;
+
+struct IABtreeLoader
+{
+	Relation	heap;
+	Relation	index;
+	RelFileNode node;		/* file the pages are written to */
+	BTScanInsert inskey;	/* to truncate the high keys */
+	bool		use_wal;
+	BlockNumber pages_alloced;	/* blocks given to the pages */
+	BlockNumber pages_written;	/* blocks in the file */
+	Page		zeropage;	/* to fill the blocks written out of order */
+	IABtreeLevel *leaf;		/* NULL until the first tuple */
+	double		ntuples;
+};
+
+static Page new_page(uint32 level);
+static void write_page(IABtreeLoader *loader, Page page, BlockNumber blkno);
+static IABtreeLevel *new_level(IABtreeLoader *loader, uint32 level);
+static void slide_left(Page page);
+static void add_page_tuple(Page page, Size itemsize, IndexTuple itup,
+						   OffsetNumber off, bool newfirstdataitem);
+static void add_level_tuple(IABtreeLoader *loader, IABtreeLevel *state,
+							IndexTuple itup);
+static void unload_page(Page page, IABtreeUnloadCallback callback, void *arg);
+static void set_index_file(Relation index, Oid relfilenode);
+static void drop_file(IABtreeLoader *loader);
+static void free_loader(IABtreeLoader *loader);
+
+/*
+ * Start loading the index into a new file.  The file number is assigned
+ * here, which can not be done once the load runs in parallel mode.  The
+ * file is dropped if the transaction aborts.
+ */
+IABtreeLoader *
+IABtreeLoadBegin(Relation heapRel, Relation index)
+{
+	IABtreeLoader *loader;
+	char		persistence = index->rd_rel->relpersistence;
+
+	loader = palloc0(sizeof(IABtreeLoader));
+	loader->heap = heapRel;
+	loader->index = index;
+	loader->node = index->rd_node;
+	loader->node.relNode = GetNewRelFileNode(index->rd_rel->reltablespace,
+											 NULL, persistence);
+#if PG_VERSION_NUM >= PG_VERSION_15
+	smgrclose(RelationCreateStorage(loader->node, persistence, true));
+#else
+	smgrclose(RelationCreateStorage(loader->node, persistence));
+#endif
+	loader->inskey = _bt_mkscankey(index, NULL);
+#if PG_VERSION_NUM >= PG_VERSION_13
+	loader->inskey->allequalimage = _bt_allequalimage(index, false);
+#endif
+	/* with wal_level minimal, the file is synced at the end of the load */
+	loader->use_wal = XLogIsNeeded() && RelationNeedsWAL(index);
+	/* the metapage is written last */
+	loader->pages_alloced = BTREE_METAPAGE + 1;
+	loader->pages_written = 0;
+
+	return loader;
+}
+
+/*
+ * Add the next tuple, not lower than the ones already added.
+ */
+void
+IABtreeLoadAdd(IABtreeLoader *loader, IndexTuple itup)
+{
+	if (loader->leaf == NULL)
+		loader->leaf = new_level(loader, 0);
+
+	add_level_tuple(loader, loader->leaf, itup);
+	loader->ntuples++;
+}
+
+/*
+ * Write the last page of each level and the metapage pointing to the root,
+ * then make the loaded file the one of the index.  Returns the number of
+ * tuples loaded.
+ */
+double
+IABtreeLoadEnd(IABtreeLoader *loader)
+{
+	IABtreeLevel *s;
+	BlockNumber rootblkno = P_NONE;
+	uint32		rootlevel = 0;
+	Page		metapage;
+	double		ntuples = loader->ntuples;
+
+	for (s = loader->leaf; s != NULL; s = s->next)
+	{
+		BTPageOpaque opaque = (BTPageOpaque) PageGetSpecialPointer(s->page);
+
+		/* the top page is the root, the others get a downlink */
+		if (s->next == NULL)
+		{
+			opaque->btpo_flags |= BTP_ROOT;
+			rootblkno = s->blkno;
+			rootlevel = s->level;
+		}
+		else
+		{
+			BTreeTupleSetDownLinkCompat(s->lowkey, s->blkno);
+			add_level_tuple(loader, s->next, s->lowkey);
+			pfree(s->lowkey);
+			s->lowkey = NULL;
+		}
+
+		/* rightmost page: no high key */
+		slide_left(s->page);
+		write_page(loader, s->page, s->blkno);
+		s->page = NULL;
+	}
+
+	metapage = (Page) palloc(BLCKSZ);
+#if PG_VERSION_NUM >= PG_VERSION_13
+	_bt_initmetapage(metapage, rootblkno, rootlevel,
+					 loader->inskey->allequalimage);
+#else
+	_bt_initmetapage(metapage, rootblkno, rootlevel);
+#endif
+	write_page(loader, metapage, BTREE_METAPAGE);
+
+	/*
+	 * The pages did not go through the shared buffers: a checkpoint taken
+	 * meanwhile could not flush them, whatever their WAL.
+	 */
+	if (RelationNeedsWAL(loader->index))
+		smgrimmedsync(LoaderSmgr(loader), MAIN_FORKNUM);
+
+	set_index_file(loader->index, loader->node.relNode);
+	free_loader(loader);
+
+	return ntuples;
+}
+
+/*
+ * Give the tuples added so far back to callback, in order, and drop the
+ * load.  The leaf pages already written are read back from the loaded
+ * file, which is dropped at commit.
+ */
+void
+IABtreeLoadUnload(IABtreeLoader *loader, IABtreeUnloadCallback callback,
+				  void *arg)
+{
+	IABtreeLevel *leaf = loader->leaf;
+
+	if (leaf != NULL)
+	{
+		PGAlignedBlock buf;
+		BlockNumber blkno = BTREE_METAPAGE + 1;	/* leftmost leaf */
+
+		/* up to the current leaf page, still in memory */
+		while (blkno != leaf->blkno)
+		{
+			Page		page = (Page) buf.data;
+
+			CHECK_FOR_INTERRUPTS();
+
+			smgrread(LoaderSmgr(loader), MAIN_FORKNUM, blkno, buf.data);
+			unload_page(page, callback, arg);
+			blkno = ((BTPageOpaque) PageGetSpecialPointer(page))->btpo_next;
+		}
+		unload_page(leaf->page, callback, arg);
+	}
+
+	drop_file(loader);
+	free_loader(loader);
+}
+
+/*
+ * Give the data items of a leaf page to callback.
+ */
+static void
+unload_page(Page page, IABtreeUnloadCallback callback, void *arg)
+{
+	OffsetNumber off;
+	OffsetNumber maxoff = PageGetMaxOffsetNumber(page);
+
+	for (off = P_FIRSTKEY; off <= maxoff; off = OffsetNumberNext(off))
+		callback((IndexTuple) PageGetItem(page, PageGetItemId(page, off)), arg);
+}
+
+/*
+ * Make the loaded file the one of the index, as RelationSetNewRelfilenode()
+ * does with the file it creates: the previous file is dropped at commit,
+ * the loaded one at abort.  The statistics are left to the caller.
+ */
+static void
+set_index_file(Relation index, Oid relfilenode)
+{
+	Relation	pg_class;
+	HeapTuple	tuple;
+	Form_pg_class classform;
+
+	pg_class = table_open(RelationRelationId, RowExclusiveLock);
+
+	tuple = SearchSysCacheCopy1(RELOID,
+								ObjectIdGetDatum(RelationGetRelid(index)));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "could not find tuple for relation %u",
+			 RelationGetRelid(index));
+	classform = (Form_pg_class) GETSTRUCT(tuple);
+
+	RelationDropStorage(index);
+
+	classform->relfilenode = relfilenode;
+	classform->relpages = 0;
+#if PG_VERSION_NUM >= PG_VERSION_14
+	classform->reltuples = -1;
+#else
+	classform->reltuples = 0;
+#endif
+	classform->relallvisible = 0;
+
+	CatalogTupleUpdate(pg_class, &tuple->t_self, tuple);
+	heap_freetuple(tuple);
+	table_close(pg_class, RowExclusiveLock);
+
+	CommandCounterIncrement();
+
+#if PG_VERSION_NUM >= PG_VERSION_13
+	RelationAssumeNewRelfilenode(index);
+#endif
+}
+
+/*
+ * Drop the loaded file at commit, as RelationDropStorage() does for the
+ * file of a relation: it only needs the file to be set.
+ */
+static void
+drop_file(IABtreeLoader *loader)
+{
+	RelationData rel;
+
+	MemSet(&rel, 0, sizeof(RelationData));
+	rel.rd_node = loader->node;
+	rel.rd_backend = InvalidBackendId;
+	RelationDropStorage(&rel);
+}
+
+static void
+free_loader(IABtreeLoader *loader)
+{
+	IABtreeLevel *s = loader->leaf;
+
+	while (s != NULL)
+	{
+		IABtreeLevel *next = s->next;
+
+		if (s->page != NULL)
+			pfree(s->page);
+		if (s->lowkey != NULL)
+			pfree(s->lowkey);
+		pfree(s);
+		s = next;
+	}
+
+	pfree(loader->inskey);
+	if (loader->zeropage != NULL)
+		pfree(loader->zeropage);
+	pfree(loader);
+}
+
+static Page
+new_page(uint32 level)
+{
+	Page		page;
+	BTPageOpaque opaque;
+
+	page = (Page) palloc(BLCKSZ);
+	_bt_pageinit(page, BLCKSZ);
+
+	opaque = (BTPageOpaque) PageGetSpecialPointer(page);
+	opaque->btpo_prev = opaque->btpo_next = P_NONE;
+	BTPageSetLevel(opaque, level);
+	opaque->btpo_flags = (level > 0) ? 0 : BTP_LEAF;
+	opaque->btpo_cycleid = 0;
+
+	/* room for the high key line pointer */
+	((PageHeader) page)->pd_lower += sizeof(ItemIdData);
+
+	return page;
+}
+
+/*
+ * Write a finished page and free it.  The pages of the upper levels are
+ * finished after the ones allocated after them: the blocks in between are
+ * zero-filled until they are written.
+ */
+static void
+write_page(IABtreeLoader *loader, Page page, BlockNumber blkno)
+{
+	if (loader->use_wal)
+		log_newpage(&loader->node, MAIN_FORKNUM, blkno, page, true);
+
+	while (blkno > loader->pages_written)
+	{
+		if (loader->zeropage == NULL)
+			loader->zeropage = (Page) palloc0(BLCKSZ);
+		smgrextend(LoaderSmgr(loader), MAIN_FORKNUM,
+				   loader->pages_written++, (char *) loader->zeropage, true);
+	}
+
+	PageSetChecksumInplace(page, blkno);
+
+	if (blkno == loader->pages_written)
+	{
+		smgrextend(LoaderSmgr(loader), MAIN_FORKNUM, blkno,
+				   (char *) page, true);
+		loader->pages_written++;
+	}
+	else
+		smgrwrite(LoaderSmgr(loader), MAIN_FORKNUM, blkno,
+				  (char *) page, true);
+
+	pfree(page);
+}
+
+static IABtreeLevel *
+new_level(IABtreeLoader *loader, uint32 level)
+{
+	IABtreeLevel *state = palloc0(sizeof(IABtreeLevel));
+
+	state->page = new_page(level);
+	state->blkno = loader->pages_alloced++;
+	state->lowkey = NULL;
+	state->lastoff = P_HIKEY;
+	state->level = level;
+	if (level > 0)
+		state->full = BLCKSZ * (100 - BTREE_NONLEAF_FILLFACTOR) / 100;
+	else
+		state->full = BTTargetFreeSpace(loader->index);
+	state->next = NULL;
+
+	return state;
+}
+
+/*
+ * Move the line pointers of the rightmost page of a level one slot back,
+ * over the high key it does not have.
+ */
+static void
+slide_left(Page page)
+{
+	OffsetNumber off;
+	OffsetNumber maxoff;
+	ItemId		previi;
+
+	maxoff = PageGetMaxOffsetNumber(page);
+	previi = PageGetItemId(page, P_HIKEY);
+	for (off = P_FIRSTKEY; off <= maxoff; off = OffsetNumberNext(off))
+	{
+		ItemId		thisii = PageGetItemId(page, off);
+
+		*previi = *thisii;
+		previi = thisii;
+	}
+	((PageHeader) page)->pd_lower -= sizeof(ItemIdData);
+}
+
+/*
+ * Add a tuple to a page, truncated to its downlink when it is the first
+ * data item of an internal page (minus infinity).
+ */
+static void
+add_page_tuple(Page page, Size itemsize, IndexTuple itup, OffsetNumber off,
+			   bool newfirstdataitem)
+{
+	IndexTupleData trunctuple;
+
+	if (newfirstdataitem)
+	{
+		trunctuple = *itup;
+		trunctuple.t_info = sizeof(IndexTupleData);
+		BTreeTupleSetNAttsCompat(&trunctuple, 0);
+		itup = &trunctuple;
+		itemsize = sizeof(IndexTupleData);
+	}
+
+	if (PageAddItem(page, (Item) itup, itemsize, off, false, false) ==
+		InvalidOffsetNumber)
+		elog(ERROR, "failed to add item to the index page");
+}
+
+/*
+ * Add a tuple to the current page of a level.  When it is full, its last
+ * tuple moves to a new page, becomes its (truncated) high key, and the
+ * page is linked into the level above.
+ */
+static void
+add_level_tuple(IABtreeLoader *loader, IABtreeLevel *state, IndexTuple itup)
+{
+	Page		npage = state->page;
+	BlockNumber nblkno = state->blkno;
+	OffsetNumber last_off = state->lastoff;
+	bool		isleaf = (state->level == 0);
+	Size		pgspc;
+	Size		itupsz;
+
+	CHECK_FOR_INTERRUPTS();
+
+	pgspc = PageGetFreeSpace(npage);
+	itupsz = MAXALIGN(IndexTupleSize(itup));
+
+	if (unlikely(itupsz > BTMaxItemSize(npage)))
+#if PG_VERSION_NUM >= PG_VERSION_13
+		_bt_check_third_page(loader->index, loader->heap, isleaf, npage, itup);
+#else
+		_bt_check_third_page(loader->index, loader->heap, true, npage, itup);
+#endif
+
+	/* a leaf high key may get a heap TID on truncation */
+	if (pgspc < itupsz + (isleaf ? MAXALIGN(sizeof(ItemPointerData)) : 0) ||
+		(pgspc < state->full && last_off > P_FIRSTKEY))
+	{
+		Page		opage = npage;
+		BlockNumber oblkno = nblkno;
+		ItemId		ii;
+		ItemId		hii;
+		IndexTuple	oitup;
+		BTPageOpaque oopaque;
+		BTPageOpaque nopaque;
+
+		npage = new_page(state->level);
+		nblkno = loader->pages_alloced++;
+
+		/* the last item moves to the new page and becomes the high key */
+		ii = PageGetItemId(opage, last_off);
+		oitup = (IndexTuple) PageGetItem(opage, ii);
+		add_page_tuple(npage, ItemIdGetLength(ii), oitup, P_FIRSTKEY, !isleaf);
+
+		hii = PageGetItemId(opage, P_HIKEY);
+		*hii = *ii;
+		ItemIdSetUnused(ii);
+		((PageHeader) opage)->pd_lower -= sizeof(ItemIdData);
+
+		if (isleaf)
+		{
+			IndexTuple	lastleft;
+			IndexTuple	truncated;
+
+			ii = PageGetItemId(opage, OffsetNumberPrev(last_off));
+			lastleft = (IndexTuple) PageGetItem(opage, ii);
+
+			truncated = _bt_truncate(loader->index, lastleft, oitup,
+									 loader->inskey);
+			if (!PageIndexTupleOverwrite(opage, P_HIKEY, (Item) truncated,
+										 IndexTupleSize(truncated)))
+				elog(ERROR, "failed to add high key to the index page");
+			pfree(truncated);
+
+			hii = PageGetItemId(opage, P_HIKEY);
+			oitup = (IndexTuple) PageGetItem(opage, hii);
+		}
+
+		/* link the old page into the level above, created if needed */
+		if (state->next == NULL)
+			state->next = new_level(loader, state->level + 1);
+
+		BTreeTupleSetDownLinkCompat(state->lowkey, oblkno);
+		add_level_tuple(loader, state->next, state->lowkey);
+		pfree(state->lowkey);
+
+		/* the high key of the old page is the low key of the new one */
+		state->lowkey = CopyIndexTuple(oitup);
+
+		oopaque = (BTPageOpaque) PageGetSpecialPointer(opage);
+		nopaque = (BTPageOpaque) PageGetSpecialPointer(npage);
+		oopaque->btpo_next = nblkno;
+		nopaque->btpo_prev = oblkno;
+		nopaque->btpo_next = P_NONE;
+
+		write_page(loader, opage, oblkno);
+
+		last_off = P_FIRSTKEY;
+	}
+
+	/* first item of the level: its low key is minus infinity */
+	if (last_off == P_HIKEY)
+	{
+		state->lowkey = palloc0(sizeof(IndexTupleData));
+		state->lowkey->t_info = sizeof(IndexTupleData);
+		BTreeTupleSetNAttsCompat(state->lowkey, 0);
+	}
+
+	last_off = OffsetNumberNext(last_off);
+	add_page_tuple(npage, itupsz, itup, last_off,
+				   !isleaf && last_off == P_FIRSTKEY);
+
+	state->page = npage;
+	state->blkno = nblkno;
+	state->lastoff = last_off;
+}
+
+#endif
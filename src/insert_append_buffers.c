@@ -0,0 +1,199 @@
+/*
+ *  insert_append_buffers.c
+ *
+ *      This file is part of the pg_directpaths module.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2022: Bertrand Drouvot
+ *
+ */
+
+#include "include/pg_directpaths.h"
+
+#include <sys/mman.h>
+#include "storage/pg_shmem.h"
+#include "include/insert_append_buffers.h"
+
+/*
+ * Pool of the blocks buffers of the direct path writers, kept mapped by the
+ * backend between statements so that a series of inserts does not fault
+ * in new memory each time.
+ */
+#define IA_POOL_SLOTS	16
+
+/* used when the size of the huge pages can not be asked for */
+#define IA_DEFAULT_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+typedef struct IAPooledBuffer
+{
+	char	   *buf;
+	Size		size;	/* mapped size */
+} IAPooledBuffer;
+
+int			ia_huge_pages = HUGE_PAGES_TRY;
+
+const struct config_enum_entry ia_huge_pages_options[] = {
+	{"off", HUGE_PAGES_OFF, false},
+	{"on", HUGE_PAGES_ON, false},
+	{"try", HUGE_PAGES_TRY, false},
+	{NULL, 0, false}
+};
+
+int			ia_buffer_pool_size = 131072;
+
+static IAPooledBuffer pool[IA_POOL_SLOTS];
+static int	pool_count = 0;
+static Size pool_bytes = 0;
+
+static char *map_buffer(Size size, Size *mapped);
+static void unmap_pooled(int slot);
+
+/*
+ * Map a new buffer, with huge pages if they are wanted.  Returns NULL when
+ * out of memory.
+ */
+static char *
+map_buffer(Size size, Size *mapped)
+{
+	char	   *buf;
+
+#ifdef MAP_HUGETLB
+	if (ia_huge_pages != HUGE_PAGES_OFF)
+	{
+		Size		hugepagesize = IA_DEFAULT_HUGE_PAGE_SIZE;
+		int			mmap_flags = MAP_HUGETLB;
+
+#if PG_VERSION_NUM >= PG_VERSION_15
+		GetHugePageSize(&hugepagesize, &mmap_flags);
+#endif
+		*mapped = TYPEALIGN(hugepagesize, size);
+		buf = mmap(NULL, *mapped, PROT_READ | PROT_WRITE,
+				   MAP_PRIVATE | MAP_ANONYMOUS | mmap_flags, -1, 0);
+		if (buf != MAP_FAILED)
+			return buf;
+
+		if (ia_huge_pages == HUGE_PAGES_ON)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("could not map a direct path buffer of %zu bytes with huge pages: %m",
+							*mapped)));
+
+		ereport(DEBUG1,
+				(errmsg("could not map a direct path buffer with huge pages, using regular pages: %m")));
+	}
+#else
+	if (ia_huge_pages == HUGE_PAGES_ON)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("huge pages not supported on this platform")));
+#endif
+
+	*mapped = size;
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buf == MAP_FAILED)
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	/* transparent huge pages then, if enabled for madvise */
+	if (ia_huge_pages != HUGE_PAGES_OFF)
+		(void) madvise(buf, size, MADV_HUGEPAGE);
+#endif
+
+	return buf;
+}
+
+static void
+unmap_pooled(int slot)
+{
+	(void) munmap(pool[slot].buf, pool[slot].size);
+	pool_bytes -= pool[slot].size;
+	pool[slot] = pool[--pool_count];
+}
+
+/*
+ * Check out a buffer of at least size bytes, the smallest large enough one
+ * of the pool if any.  *allocated is set to its actual size, to be given
+ * back to IABufferRelease().  Returns NULL when out of memory, after the
+ * pool has been emptied.
+ */
+char *
+IABufferGet(Size size, Size *allocated)
+{
+	int			best = -1;
+	int			i;
+	char	   *buf;
+
+	for (i = 0; i < pool_count; i++)
+	{
+		if (pool[i].size >= size &&
+			(best == -1 || pool[i].size < pool[best].size))
+			best = i;
+	}
+
+	if (best != -1)
+	{
+		buf = pool[best].buf;
+		*allocated = pool[best].size;
+		pool_bytes -= pool[best].size;
+		pool[best] = pool[--pool_count];
+		return buf;
+	}
+
+	buf = map_buffer(size, allocated);
+	if (buf == NULL && pool_count > 0)
+	{
+		/* the pooled buffers are too small anyway */
+		while (pool_count > 0)
+			unmap_pooled(0);
+		buf = map_buffer(size, allocated);
+	}
+
+	return buf;
+}
+
+/*
+ * Give a buffer back to the pool, making room by unmapping smaller pooled
+ * buffers if needed, or unmap it when it does not fit in
+ * pg_directpaths.buffer_pool_size.
+ */
+void
+IABufferRelease(char *buf, Size size)
+{
+	Size		limit = (Size) ia_buffer_pool_size * 1024;
+
+	while (pool_count > 0 &&
+		   (pool_count == IA_POOL_SLOTS || pool_bytes + size > limit))
+	{
+		int			smallest = 0;
+		int			i;
+
+		for (i = 1; i < pool_count; i++)
+		{
+			if (pool[i].size < pool[smallest].size)
+				smallest = i;
+		}
+
+		if (pool[smallest].size >= size)
+			break;
+
+		unmap_pooled(smallest);
+	}
+
+	if (pool_count < IA_POOL_SLOTS && pool_bytes + size <= limit)
+	{
+		pool[pool_count].buf = buf;
+		pool[pool_count].size = size;
+		pool_count++;
+		pool_bytes += size;
+		return;
+	}
+
+	(void) munmap(buf, size);
+}
@@ -12,23 +12,436 @@
 
 #include "include/pg_directpaths.h"
 
+#include "access/brin.h"
+#include "access/genam.h"
 #include "access/heapam.h"
+#include "access/itup.h"
+#include "access/parallel.h"
+#include "access/stratnum.h"
 #include "access/xact.h"
 #include "catalog/index.h"
+#include "catalog/indexing.h"
+#include "catalog/pg_am.h"
+#include "catalog/pg_index.h"
+#include "commands/vacuum.h"
+#include "executor/executor.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/shm_toc.h"
+#include "utils/fmgrprotos.h"
+#include "utils/guc.h"
+#include "utils/rel.h"
+#include "utils/relcache.h"
+#include "utils/snapmgr.h"
+#include "utils/sortsupport.h"
+#include "utils/syscache.h"
+#include "utils/tuplesort.h"
+#include "include/insert_append_btree.h"
 #include "include/insert_append_indexes.h"
 
-#if PG_VERSION_NUM < PG_VERSION_12
-#include "utils/rel.h"
+#if PG_VERSION_NUM >= PG_VERSION_12
+#include "access/table.h"
+#include "access/tableam.h"
+#endif
+
+#if PG_VERSION_NUM >= PG_VERSION_12
+#define index_ambuild(h, i, ii) ((i)->rd_indam->ambuild((h), (i), (ii)))
+#else
+#define index_ambuild(h, i, ii) ((i)->rd_amroutine->ambuild((h), (i), (ii)))
+#endif
+
+#define IA_BUILD_KEY_SHARED		UINT64CONST(0xD1AEC7A000000001)
+
+/*
+ * An index built by the participants of a concurrent rebuild, and what its
+ * build found.
+ */
+typedef struct IABuildIndex
+{
+	Oid			indexrelid;
+	BlockNumber relpages;		/* size before the rebuild */
+	double		heap_tuples;
+	double		index_tuples;
+	bool		broken_hot_chain;
+} IABuildIndex;
+
+/*
+ * Shared by the participants: each of them builds the next index nobody
+ * took yet, until there is none left.
+ */
+typedef struct IABuildShared
+{
+	Oid			heaprelid;
+	int			nindexes;
+	pg_atomic_uint32 next_index;
+	IABuildIndex indexes[FLEXIBLE_ARRAY_MEMBER];
+} IABuildShared;
+
+/*
+ * B-tree index of a spool.  Its keys go straight to the loader as long as
+ * they come in order, and are sorted from the first one that does not.
+ */
+typedef struct IASpoolIndex
+{
+	Relation	index;			/* opened for the spool */
+	IndexInfo  *indexInfo;
+	ExprState  *predicate;
+	IABtreeLoader *loader;		/* NULL once the keys are sorted */
+	Tuplesortstate *sort;		/* NULL while they come in order */
+	SortSupport sortKeys;		/* one per key column */
+	int			nkeys;
+	IndexTuple	last;			/* last key loaded, NULL if none */
+} IASpoolIndex;
+
+/*
+ * Keys of the rows loaded into an empty relation, for each of its B-tree
+ * indexes.
+ */
+struct IAIndexSpool
+{
+	Relation	heapRel;
+	MemoryContext mcxt;			/* holds the loaders and the sorts */
+	int			nindexes;
+	IASpoolIndex *indexes;
+	int			workMem;		/* of each sort */
+	EState	   *estate;
+	TupleTableSlot *slot;
+	double		nrows;
+};
+
+int			ia_index_merge_ratio = 20;
+bool		ia_index_spool = true;
+
+static bool can_merge_index(Relation index, IndexInfo *indexInfo);
+static bool can_summarize_index(Relation index);
+static void summarize_appended_ranges(Relation heapRel, Relation index,
+									  BlockNumber startblk,
+									  BlockNumber nblocks);
+static bool can_build_concurrently(Relation heapRel, Relation index,
+								   IndexInfo *indexInfo);
+static void build_indexes_concurrently(Relation heapRel, RelationPtr indices,
+									   bool *concurrent, int numIndices,
+									   int nconcurrent);
+static void build_next_indexes(IABuildShared *shared);
+static void build_spooled_indexes(Relation heapRel, IAIndexSpool *spool,
+								  RelationPtr indices, bool *spooled,
+								  int numIndices);
+#if PG_VERSION_NUM >= PG_VERSION_12
+static void stream_index_key(IAIndexSpool *spool, IASpoolIndex *si,
+							 Datum *values, bool *isnull, ItemPointer tid);
+static int	compare_last_key(IASpoolIndex *si, Datum *values, bool *isnull);
+static void sort_index_keys(IAIndexSpool *spool, IASpoolIndex *si);
+static void sort_unloaded_key(IndexTuple itup, void *arg);
+#endif
+static int	compare_build_size(const void *a, const void *b);
+static void update_relstats(Relation rel, double reltuples);
+static void set_index_check_xmin(Oid indexOid);
+static void merge_indexes(Relation heapRel, ResultRelInfo *resultRelInfo,
+						  bool *merged, BlockNumber startblk,
+						  BlockNumber nblocks);
+static Tuplesortstate *begin_index_spool(Relation heapRel, Relation index,
+										 IndexInfo *indexInfo, bool unique,
+										 int workMem);
+
+/*
+ * Start gathering the B-tree keys of the rows about to be loaded into the
+ * empty heapRel.  Returns NULL when none of its indexes can be built from
+ * them.
+ */
+IAIndexSpool *
+IAIndexSpoolStart(Relation heapRel)
+{
+#if PG_VERSION_NUM >= PG_VERSION_12
+	IAIndexSpool *spool;
+	List	   *indexoids;
+	ListCell   *lc;
+	int			n = 0;
+	int			i;
+	int			k;
+
+	if (!ia_index_spool ||
+		heapRel->rd_rel->relpersistence != RELPERSISTENCE_PERMANENT)
+		return NULL;
+
+	indexoids = RelationGetIndexList(heapRel);
+	if (indexoids == NIL)
+		return NULL;
+
+	spool = palloc0(sizeof(IAIndexSpool));
+	spool->heapRel = heapRel;
+	spool->mcxt = CurrentMemoryContext;
+	spool->indexes = palloc0(sizeof(IASpoolIndex) * list_length(indexoids));
+
+	foreach(lc, indexoids)
+	{
+		Relation	index = index_open(lfirst_oid(lc), RowExclusiveLock);
+		IndexInfo  *indexInfo = BuildIndexInfo(index);
+
+		/*
+		 * The same B-tree indexes as the ones the rows can be merged into,
+		 * whose file is set by pg_class.
+		 */
+		if (can_merge_index(index, indexInfo) && !RelationIsMapped(index))
+		{
+			spool->indexes[n].index = index;
+			spool->indexes[n].indexInfo = indexInfo;
+			n++;
+		}
+		else
+			index_close(index, RowExclusiveLock);
+	}
+	list_free(indexoids);
+
+	if (n == 0)
+	{
+		pfree(spool->indexes);
+		pfree(spool);
+		return NULL;
+	}
+
+	spool->nindexes = n;
+	spool->workMem = Max(maintenance_work_mem / n, 64);
+	spool->estate = CreateExecutorState();
+	spool->slot = MakeSingleTupleTableSlot(RelationGetDescr(heapRel),
+										   &TTSOpsHeapTuple);
+	GetPerTupleExprContext(spool->estate)->ecxt_scantuple = spool->slot;
+
+	for (i = 0; i < n; i++)
+	{
+		IASpoolIndex *si = &spool->indexes[i];
+		Relation	index = si->index;
+
+		si->predicate = ExecPrepareQual(si->indexInfo->ii_Predicate,
+										spool->estate);
+
+		/*
+		 * The keys are loaded as they come, into a new file that the index
+		 * gets at the end of the load.  The file is created before the
+		 * source query can enter parallel mode.
+		 */
+		LockRelationOid(RelationGetRelid(index), AccessExclusiveLock);
+		si->loader = IABtreeLoadBegin(heapRel, index);
+
+		/* compared as the sort of the index build would */
+		si->nkeys = IndexRelationGetNumberOfKeyAttributes(index);
+		si->sortKeys = palloc0(sizeof(SortSupportData) * si->nkeys);
+		for (k = 0; k < si->nkeys; k++)
+		{
+			SortSupport sortKey = &si->sortKeys[k];
+			int16		strategy;
+
+			sortKey->ssup_cxt = spool->mcxt;
+			sortKey->ssup_collation = index->rd_indcollation[k];
+			sortKey->ssup_nulls_first =
+				(index->rd_indoption[k] & INDOPTION_NULLS_FIRST) != 0;
+			sortKey->ssup_attno = k + 1;
+			sortKey->abbreviate = false;
+
+			strategy = (index->rd_indoption[k] & INDOPTION_DESC) != 0 ?
+				BTGreaterStrategyNumber : BTLessStrategyNumber;
+			PrepareSortSupportFromIndexRel(index, strategy, sortKey);
+		}
+	}
+
+	return spool;
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Add the keys of a loaded row, stored at tid.
+ */
+void
+IAIndexSpoolAdd(IAIndexSpool *spool, HeapTuple tuple, ItemPointer tid)
+{
+#if PG_VERSION_NUM >= PG_VERSION_12
+	ExprContext *econtext = GetPerTupleExprContext(spool->estate);
+	Datum		values[INDEX_MAX_KEYS];
+	bool		isnull[INDEX_MAX_KEYS];
+	int			i;
+
+	ResetPerTupleExprContext(spool->estate);
+	ExecStoreHeapTuple(tuple, spool->slot, false);
+
+	for (i = 0; i < spool->nindexes; i++)
+	{
+		IASpoolIndex *si = &spool->indexes[i];
+
+		if (si->predicate != NULL && !ExecQual(si->predicate, econtext))
+			continue;
+
+		FormIndexDatum(si->indexInfo, spool->slot, spool->estate,
+					   values, isnull);
+
+		if (si->loader != NULL)
+			stream_index_key(spool, si, values, isnull, tid);
+		else
+			tuplesort_putindextuplevalues(si->sort, si->index, tid,
+										  values, isnull);
+	}
+
+	ExecClearTuple(spool->slot);
+	spool->nrows++;
+#endif
+}
+
+#if PG_VERSION_NUM >= PG_VERSION_12
+/*
+ * Load the key of a row stored at tid, or start sorting the keys of the
+ * index when it is lower than the last one loaded.  The rows are stored in
+ * TID order, so equal keys are in the order of the index.
+ */
+static void
+stream_index_key(IAIndexSpool *spool, IASpoolIndex *si, Datum *values,
+				 bool *isnull, ItemPointer tid)
+{
+	MemoryContext oldcxt;
+	IndexTuple	itup;
+
+	if (si->last != NULL)
+	{
+		int			cmp = compare_last_key(si, values, isnull);
+
+		if (cmp > 0)
+		{
+			sort_index_keys(spool, si);
+			tuplesort_putindextuplevalues(si->sort, si->index, tid,
+										  values, isnull);
+			return;
+		}
+
+		/* duplicates are next to each other */
+		if (cmp == 0 && si->indexInfo->ii_Unique)
+		{
+			bool		hasnull = false;
+			int			k;
+
+			for (k = 0; k < si->nkeys; k++)
+				hasnull |= isnull[k];
+
+#if PG_VERSION_NUM >= PG_VERSION_15
+			if (!hasnull || si->indexInfo->ii_NullsNotDistinct)
+#else
+			if (!hasnull)
+#endif
+			{
+				char	   *key_desc;
+
+				key_desc = BuildIndexValueDescription(si->index, values,
+													  isnull);
+				ereport(ERROR,
+						(errcode(ERRCODE_UNIQUE_VIOLATION),
+						 errmsg("could not create unique index \"%s\"",
+								RelationGetRelationName(si->index)),
+						 key_desc ? errdetail("Key %s is duplicated.", key_desc) :
+						 errdetail("Duplicate keys exist."),
+						 errtableconstraint(spool->heapRel,
+											RelationGetRelationName(si->index))));
+			}
+		}
+	}
+
+	oldcxt = MemoryContextSwitchTo(spool->mcxt);
+
+	itup = index_form_tuple(RelationGetDescr(si->index), values, isnull);
+	itup->t_tid = *tid;
+	IABtreeLoadAdd(si->loader, itup);
+
+	if (si->last != NULL)
+		pfree(si->last);
+	si->last = itup;
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Compare the last key loaded with the key in values.
+ */
+static int
+compare_last_key(IASpoolIndex *si, Datum *values, bool *isnull)
+{
+	TupleDesc	tupdesc = RelationGetDescr(si->index);
+	int			k;
+
+	for (k = 0; k < si->nkeys; k++)
+	{
+		Datum		lastval;
+		bool		lastnull;
+		int			cmp;
+
+		lastval = index_getattr(si->last, k + 1, tupdesc, &lastnull);
+		cmp = ApplySortComparator(lastval, lastnull, values[k], isnull[k],
+								  &si->sortKeys[k]);
+		if (cmp != 0)
+			return cmp;
+	}
+
+	return 0;
+}
+
+/*
+ * Switch the index from the load to the sort, which gets the keys loaded
+ * so far.  The file they were written to is dropped at commit.
+ */
+static void
+sort_index_keys(IAIndexSpool *spool, IASpoolIndex *si)
+{
+	MemoryContext oldcxt = MemoryContextSwitchTo(spool->mcxt);
+
+	ereport(DEBUG1,
+			(errmsg("rows not in the order of index \"%s\", sorting its keys",
+					RelationGetRelationName(si->index))));
+
+	si->sort = begin_index_spool(spool->heapRel, si->index, si->indexInfo,
+								 true, spool->workMem);
+	IABtreeLoadUnload(si->loader, sort_unloaded_key, si);
+	si->loader = NULL;
+
+	pfree(si->last);
+	si->last = NULL;
+
+	MemoryContextSwitchTo(oldcxt);
+}
+
+static void
+sort_unloaded_key(IndexTuple itup, void *arg)
+{
+	IASpoolIndex *si = (IASpoolIndex *) arg;
+	Datum		values[INDEX_MAX_KEYS];
+	bool		isnull[INDEX_MAX_KEYS];
+
+	index_deform_tuple(itup, RelationGetDescr(si->index), values, isnull);
+	tuplesort_putindextuplevalues(si->sort, si->index, &itup->t_tid,
+								  values, isnull);
+}
 #endif
 
+/*
+ * Bring the indexes of the relation up to date with the blocks appended
+ * from startblk.  The B-tree indexes get the new rows when they only add a
+ * small part of the relation, and are built from the spool, if any, when
+ * the relation was empty.  The BRIN indexes of a relation that was not
+ * empty only get the ranges of the new blocks summarized.  The other
+ * indexes are rebuilt.
+ */
 void
-IARebuildIndexes(ResultRelInfo *resultRelInfo)
+IARebuildIndexes(ResultRelInfo *resultRelInfo, BlockNumber startblk,
+				 IAIndexSpool *spool)
 {
+	Relation		heapRel = resultRelInfo->ri_RelationDesc;
 	int				i;
 	int				numIndices;
 	RelationPtr		indices;
+	IndexInfo	  **indexInfos;
 	char			persistence;
 	Oid		indexOid;
+	BlockNumber		nblocks;
+	bool		   *merged;
+	bool		   *spooled;
+	bool		   *concurrent;
+	bool			merge = false;
+	int				nconcurrent = 0;
 
 #if PG_VERSION_NUM >= PG_VERSION_14
 	ExecOpenIndices(resultRelInfo, false);
@@ -36,12 +449,76 @@ IARebuildIndexes(ResultRelInfo *resultRelInfo)
 
 	numIndices = resultRelInfo->ri_NumIndices;
 	indices = resultRelInfo->ri_IndexRelationDescs;
+	indexInfos = resultRelInfo->ri_IndexRelationInfo;
+
+	if (numIndices == 0)
+		return;
+
+	/*
+	 * Adding the rows costs a descent of the index each, where a rebuild
+	 * sorts the whole relation: only worth it when few rows are added.
+	 */
+	nblocks = RelationGetNumberOfBlocks(heapRel);
+	merged = palloc0(sizeof(bool) * numIndices);
+	for (i = 0; i < numIndices; i++)
+	{
+		merged[i] = startblk > 0 && ia_index_merge_ratio > 0 &&
+			(uint64) (nblocks - startblk) * 100 <=
+			(uint64) nblocks * ia_index_merge_ratio &&
+			can_merge_index(indices[i], indexInfos[i]);
+		merge |= merged[i];
+	}
+
+	if (merge)
+		merge_indexes(heapRel, resultRelInfo, merged, startblk, nblocks);
+
+	/*
+	 * A BRIN index summarizes each range of blocks on its own, so whatever
+	 * the share of the new rows, only their ranges need to be read.
+	 */
+	for (i = 0; i < numIndices; i++)
+	{
+		if (startblk > 0 && !merged[i] && can_summarize_index(indices[i]))
+		{
+			summarize_appended_ranges(heapRel, indices[i], startblk, nblocks);
+			merged[i] = true;
+		}
+	}
+
+	spooled = palloc0(sizeof(bool) * numIndices);
+	if (spool != NULL)
+		build_spooled_indexes(heapRel, spool, indices, spooled, numIndices);
+
+	/*
+	 * The B-tree indexes to rebuild are built at the same time by parallel
+	 * workers, one index each, when there are several of them.
+	 */
+	concurrent = palloc0(sizeof(bool) * numIndices);
+	for (i = 0; i < numIndices; i++)
+	{
+		concurrent[i] = !merged[i] && !spooled[i] &&
+			can_build_concurrently(heapRel, indices[i], indexInfos[i]);
+		nconcurrent += concurrent[i];
+	}
+
+	if (nconcurrent > 1)
+		build_indexes_concurrently(heapRel, indices, concurrent, numIndices,
+								   nconcurrent);
 
 	for (i = 0; i < numIndices; i++)
 	{
 #if PG_VERSION_NUM >= PG_VERSION_14
 		ReindexParams params = {0};
 #endif
+
+		/* left opened, it is closed with the other result relation indexes */
+		if (merged[i])
+			continue;
+
+		/* already built */
+		if (spooled[i] || (nconcurrent > 1 && concurrent[i]))
+			continue;
+
 		indexOid = RelationGetRelid(indices[i]);
 		relation_close(indices[i], NoLock);
 		persistence = indices[i]->rd_rel->relpersistence;
@@ -54,4 +531,572 @@ IARebuildIndexes(ResultRelInfo *resultRelInfo)
 #endif
 		CommandCounterIncrement();
 	}
-}
\ No newline at end of file
+
+	pfree(merged);
+	pfree(spooled);
+	pfree(concurrent);
+}
+
+/*
+ * Finish the indexes of the spool, flagging them in spooled: the ones
+ * whose keys came in order are loaded already, the others are loaded from
+ * their sorted keys.  As for a REINDEX, they got a new relfilenode.
+ */
+static void
+build_spooled_indexes(Relation heapRel, IAIndexSpool *spool,
+					  RelationPtr indices, bool *spooled, int numIndices)
+{
+#if PG_VERSION_NUM >= PG_VERSION_12
+	int			i;
+	int			j;
+
+	for (j = 0; j < spool->nindexes; j++)
+	{
+		IASpoolIndex *si = &spool->indexes[j];
+		Relation	index = si->index;
+		IABtreeLoader *loader;
+		IndexTuple	itup;
+		double		ntuples;
+
+		for (i = 0; i < numIndices; i++)
+		{
+			if (indices[i] == NULL ||
+				RelationGetRelid(indices[i]) != RelationGetRelid(index))
+				continue;
+
+			spooled[i] = true;
+			relation_close(indices[i], NoLock);
+			indices[i] = NULL;
+		}
+
+		if (si->loader != NULL)
+			ntuples = IABtreeLoadEnd(si->loader);
+		else
+		{
+			/* duplicates of a unique index are reported by the sort */
+			tuplesort_performsort(si->sort);
+
+			loader = IABtreeLoadBegin(heapRel, index);
+			while ((itup = tuplesort_getindextuple(si->sort, true)) != NULL)
+				IABtreeLoadAdd(loader, itup);
+			ntuples = IABtreeLoadEnd(loader);
+
+			tuplesort_end(si->sort);
+		}
+
+		update_relstats(index, ntuples);
+		index_close(index, NoLock);
+	}
+
+	update_relstats(heapRel, spool->nrows);
+	CommandCounterIncrement();
+
+	ExecDropSingleTupleTableSlot(spool->slot);
+	FreeExecutorState(spool->estate);
+#endif
+}
+
+/*
+ * Whether the new rows can be inserted into an index rather than having it
+ * rebuilt: a valid B-tree, whose uniqueness can be checked row by row.
+ */
+static bool
+can_merge_index(Relation index, IndexInfo *indexInfo)
+{
+	return index->rd_rel->relam == BTREE_AM_OID &&
+		index->rd_index->indisvalid &&
+		index->rd_index->indisready &&
+		indexInfo->ii_ExclusionOps == NULL &&
+		(!indexInfo->ii_Unique || index->rd_index->indimmediate);
+}
+
+/*
+ * Whether the index can be kept up to date by summarizing the ranges of the
+ * new blocks: a valid BRIN.
+ */
+static bool
+can_summarize_index(Relation index)
+{
+	return index->rd_rel->relam == BRIN_AM_OID &&
+		index->rd_index->indisvalid &&
+		index->rd_index->indisready;
+}
+
+/*
+ * Summarize the ranges of the BRIN index covering the blocks appended from
+ * startblk.  The range startblk falls into may already be summarized without
+ * the new rows, it is summarized again.  The summaries are computed by the
+ * relation owner, the way VACUUM does, as the functions doing it require the
+ * index to be owned by the current user.
+ */
+static void
+summarize_appended_ranges(Relation heapRel, Relation index,
+						  BlockNumber startblk, BlockNumber nblocks)
+{
+	Oid			indexOid = RelationGetRelid(index);
+	BlockNumber pagesPerRange = BrinGetPagesPerRange(index);
+	BlockNumber blk = startblk - startblk % pagesPerRange;
+	Oid			save_userid;
+	int			save_sec_context;
+
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(heapRel->rd_rel->relowner,
+						   save_sec_context | SECURITY_RESTRICTED_OPERATION);
+
+	if (blk < startblk)
+		DirectFunctionCall2(brin_desummarize_range,
+							ObjectIdGetDatum(indexOid),
+							Int64GetDatum((int64) blk));
+
+	for (; blk < nblocks; blk += pagesPerRange)
+		DirectFunctionCall2(brin_summarize_range,
+							ObjectIdGetDatum(indexOid),
+							Int64GetDatum((int64) blk));
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+	CommandCounterIncrement();
+}
+
+/*
+ * Whether a parallel worker can build the index on its own: a valid B-tree
+ * on plain columns of a permanent relation, which leaves nothing but its
+ * pages to the build.
+ */
+static bool
+can_build_concurrently(Relation heapRel, Relation index, IndexInfo *indexInfo)
+{
+#if PG_VERSION_NUM >= PG_VERSION_11
+	return max_parallel_maintenance_workers > 0 &&
+		heapRel->rd_rel->relpersistence == RELPERSISTENCE_PERMANENT &&
+		index->rd_rel->relam == BTREE_AM_OID &&
+		index->rd_index->indisvalid &&
+		index->rd_index->indisready &&
+		indexInfo->ii_Expressions == NIL &&
+		indexInfo->ii_Predicate == NIL &&
+		indexInfo->ii_ExclusionOps == NULL;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Rebuild the indexes flagged in concurrent, the leader and up to
+ * max_parallel_maintenance_workers workers each building one at a time,
+ * the largest ones first.
+ *
+ * As for a REINDEX, the indexes get a new relfilenode, but the catalog
+ * updates are left to the leader: the workers only fill the new files.
+ */
+static void
+build_indexes_concurrently(Relation heapRel, RelationPtr indices,
+						   bool *concurrent, int numIndices, int nconcurrent)
+{
+#if PG_VERSION_NUM >= PG_VERSION_11
+	ParallelContext *pcxt;
+	IABuildShared *shared;
+	IABuildIndex *builds;
+	Size		size;
+	int			nworkers;
+	int			save_nestlevel;
+	char		value[32];
+	double		heap_tuples = 0;
+	int			i;
+	int			n = 0;
+
+	builds = palloc0(sizeof(IABuildIndex) * nconcurrent);
+
+	for (i = 0; i < numIndices; i++)
+	{
+		Relation	index = indices[i];
+
+		if (!concurrent[i])
+			continue;
+
+		builds[n].indexrelid = RelationGetRelid(index);
+		builds[n].relpages = index->rd_rel->relpages;
+		n++;
+
+		LockRelationOid(RelationGetRelid(index), AccessExclusiveLock);
+#if PG_VERSION_NUM >= PG_VERSION_16
+		RelationSetNewRelfilenumber(index, index->rd_rel->relpersistence);
+#elif PG_VERSION_NUM >= PG_VERSION_12
+		RelationSetNewRelfilenode(index, index->rd_rel->relpersistence);
+#else
+		RelationSetNewRelfilenode(index, index->rd_rel->relpersistence,
+								  InvalidTransactionId, InvalidMultiXactId);
+#endif
+		relation_close(index, NoLock);
+		indices[i] = NULL;
+	}
+
+	/* the workers look the new relfilenodes up */
+	CommandCounterIncrement();
+
+	qsort(builds, nconcurrent, sizeof(IABuildIndex), compare_build_size);
+
+	nworkers = Min(max_parallel_maintenance_workers, nconcurrent - 1);
+
+	/* shared by all the builds, as by the participants of a CREATE INDEX */
+	save_nestlevel = NewGUCNestLevel();
+	snprintf(value, sizeof(value), "%d",
+			 Max(maintenance_work_mem / (nworkers + 1), 1024));
+	(void) set_config_option("maintenance_work_mem", value,
+							 PGC_USERSET, PGC_S_SESSION,
+							 GUC_ACTION_SAVE, true, 0, false);
+
+	size = add_size(offsetof(IABuildShared, indexes),
+					mul_size(sizeof(IABuildIndex), nconcurrent));
+
+	EnterParallelMode();
+#if PG_VERSION_NUM >= PG_VERSION_12
+	pcxt = CreateParallelContext("pg_directpaths", "IABuildIndexesMain",
+								 nworkers);
+#else
+	pcxt = CreateParallelContext("pg_directpaths", "IABuildIndexesMain",
+								 nworkers, true);
+#endif
+	shm_toc_estimate_chunk(&pcxt->estimator, size);
+	shm_toc_estimate_keys(&pcxt->estimator, 1);
+	InitializeParallelDSM(pcxt);
+
+	shared = (IABuildShared *) shm_toc_allocate(pcxt->toc, size);
+	shared->heaprelid = RelationGetRelid(heapRel);
+	shared->nindexes = nconcurrent;
+	pg_atomic_init_u32(&shared->next_index, 0);
+	memcpy(shared->indexes, builds, sizeof(IABuildIndex) * nconcurrent);
+	shm_toc_insert(pcxt->toc, IA_BUILD_KEY_SHARED, shared);
+
+	LaunchParallelWorkers(pcxt);
+
+	ereport(DEBUG1,
+			(errmsg("building %d indexes with %d parallel workers",
+					nconcurrent, pcxt->nworkers_launched)));
+
+	/* the leader takes its share, and all of them without workers */
+	build_next_indexes(shared);
+
+	WaitForParallelWorkersToFinish(pcxt);
+
+	memcpy(builds, shared->indexes, sizeof(IABuildIndex) * nconcurrent);
+
+	DestroyParallelContext(pcxt);
+	ExitParallelMode();
+
+	AtEOXact_GUC(true, save_nestlevel);
+
+	/* what index_build() records once an index is built */
+	for (i = 0; i < nconcurrent; i++)
+	{
+		Relation	index = index_open(builds[i].indexrelid, NoLock);
+
+		update_relstats(index, builds[i].index_tuples);
+		if (builds[i].broken_hot_chain)
+			set_index_check_xmin(builds[i].indexrelid);
+		heap_tuples = builds[i].heap_tuples;
+
+		index_close(index, NoLock);
+	}
+	update_relstats(heapRel, heap_tuples);
+
+	CommandCounterIncrement();
+
+	pfree(builds);
+#endif
+}
+
+/*
+ * Parallel worker building the relation indexes with the leader.
+ */
+void
+IABuildIndexesMain(dsm_segment *seg, shm_toc *toc)
+{
+	IABuildShared *shared;
+
+	shared = (IABuildShared *) shm_toc_lookup(toc, IA_BUILD_KEY_SHARED, false);
+
+	build_next_indexes(shared);
+}
+
+/*
+ * Build the indexes not taken by another participant, the whole index by
+ * the access method, serially.  As index_build() does, the index functions
+ * run as the relation owner, in a restricted security context and with
+ * their own GUC nest level.  index_build() itself, and reindex_index(),
+ * update the catalogs, which a parallel worker can not do.
+ */
+static void
+build_next_indexes(IABuildShared *shared)
+{
+	Relation	heapRel;
+	uint32		next;
+	Oid			save_userid;
+	int			save_sec_context;
+	int			save_nestlevel;
+
+#if PG_VERSION_NUM >= PG_VERSION_12
+	heapRel = table_open(shared->heaprelid, ShareLock);
+#else
+	heapRel = heap_open(shared->heaprelid, ShareLock);
+#endif
+
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(heapRel->rd_rel->relowner,
+						   save_sec_context | SECURITY_RESTRICTED_OPERATION);
+	save_nestlevel = NewGUCNestLevel();
+
+	while ((next = pg_atomic_fetch_add_u32(&shared->next_index, 1)) <
+		   (uint32) shared->nindexes)
+	{
+		IABuildIndex *build = &shared->indexes[next];
+		Relation	index;
+		IndexInfo  *indexInfo;
+		IndexBuildResult *stats;
+
+		CHECK_FOR_INTERRUPTS();
+
+		index = index_open(build->indexrelid, RowExclusiveLock);
+		indexInfo = BuildIndexInfo(index);
+
+		stats = index_ambuild(heapRel, index, indexInfo);
+
+		build->heap_tuples = stats->heap_tuples;
+		build->index_tuples = stats->index_tuples;
+		build->broken_hot_chain = indexInfo->ii_BrokenHotChain;
+
+		index_close(index, RowExclusiveLock);
+	}
+
+	AtEOXact_GUC(false, save_nestlevel);
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+#if PG_VERSION_NUM >= PG_VERSION_12
+	table_close(heapRel, ShareLock);
+#else
+	heap_close(heapRel, ShareLock);
+#endif
+}
+
+/*
+ * Largest index first, so that the last one to start is a small one.
+ */
+static int
+compare_build_size(const void *a, const void *b)
+{
+	BlockNumber pa = ((const IABuildIndex *) a)->relpages;
+	BlockNumber pb = ((const IABuildIndex *) b)->relpages;
+
+	if (pa > pb)
+		return -1;
+	if (pa < pb)
+		return 1;
+	return 0;
+}
+
+/*
+ * Size and row count of a relation in pg_class, its other fields unchanged.
+ */
+static void
+update_relstats(Relation rel, double reltuples)
+{
+#if PG_VERSION_NUM >= PG_VERSION_15
+	vac_update_relstats(rel, RelationGetNumberOfBlocks(rel), reltuples,
+						rel->rd_rel->relallvisible, rel->rd_rel->relhasindex,
+						InvalidTransactionId, InvalidMultiXactId,
+						NULL, NULL, true);
+#else
+	vac_update_relstats(rel, RelationGetNumberOfBlocks(rel), reltuples,
+						rel->rd_rel->relallvisible, rel->rd_rel->relhasindex,
+						InvalidTransactionId, InvalidMultiXactId, true);
+#endif
+}
+
+/*
+ * The index skipped broken HOT chains: it can only be used by the
+ * transactions that can not see their older rows.
+ */
+static void
+set_index_check_xmin(Oid indexOid)
+{
+	Relation	pg_index;
+	HeapTuple	tuple;
+
+#if PG_VERSION_NUM >= PG_VERSION_12
+	pg_index = table_open(IndexRelationId, RowExclusiveLock);
+#else
+	pg_index = heap_open(IndexRelationId, RowExclusiveLock);
+#endif
+
+	tuple = SearchSysCacheCopy1(INDEXRELID, ObjectIdGetDatum(indexOid));
+	if (!HeapTupleIsValid(tuple))
+		elog(ERROR, "cache lookup failed for index %u", indexOid);
+
+	((Form_pg_index) GETSTRUCT(tuple))->indcheckxmin = true;
+	CatalogTupleUpdate(pg_index, &tuple->t_self, tuple);
+
+	heap_freetuple(tuple);
+#if PG_VERSION_NUM >= PG_VERSION_12
+	table_close(pg_index, RowExclusiveLock);
+#else
+	heap_close(pg_index, RowExclusiveLock);
+#endif
+}
+
+/*
+ * Insert the rows of the appended blocks into the merged indexes.  They are
+ * read once for all of them, and their keys sorted for each index so that
+ * the insertions go through its leaf pages in order.
+ */
+static void
+merge_indexes(Relation heapRel, ResultRelInfo *resultRelInfo, bool *merged,
+			  BlockNumber startblk, BlockNumber nblocks)
+{
+	int				numIndices = resultRelInfo->ri_NumIndices;
+	RelationPtr		indices = resultRelInfo->ri_IndexRelationDescs;
+	IndexInfo	  **indexInfos = resultRelInfo->ri_IndexRelationInfo;
+	Tuplesortstate **spools;
+	ExprState	  **predicates;
+	EState		   *estate;
+	ExprContext	   *econtext;
+	TupleTableSlot *slot;
+	Datum			values[INDEX_MAX_KEYS];
+	bool			isnull[INDEX_MAX_KEYS];
+	int				nmerged = 0;
+	int				i;
+#if PG_VERSION_NUM >= PG_VERSION_12
+	TableScanDesc	scan;
+#else
+	HeapScanDesc	scan;
+	HeapTuple		tuple;
+#endif
+
+	spools = palloc0(sizeof(Tuplesortstate *) * numIndices);
+	predicates = palloc0(sizeof(ExprState *) * numIndices);
+
+	estate = CreateExecutorState();
+	econtext = GetPerTupleExprContext(estate);
+#if PG_VERSION_NUM >= PG_VERSION_12
+	slot = table_slot_create(heapRel, NULL);
+#else
+	slot = MakeSingleTupleTableSlot(RelationGetDescr(heapRel));
+#endif
+	econtext->ecxt_scantuple = slot;
+
+	for (i = 0; i < numIndices; i++)
+		nmerged += merged[i];
+
+	for (i = 0; i < numIndices; i++)
+	{
+		if (!merged[i])
+			continue;
+
+		spools[i] = begin_index_spool(heapRel, indices[i], indexInfos[i], false,
+									  Max(maintenance_work_mem / nmerged, 64));
+		predicates[i] = ExecPrepareQual(indexInfos[i]->ii_Predicate, estate);
+	}
+
+	/* the appended rows are the only ones in these blocks */
+#if PG_VERSION_NUM >= PG_VERSION_12
+	scan = table_beginscan_strat(heapRel, SnapshotAny, 0, NULL, true, false);
+	heap_setscanlimits(scan, startblk, nblocks - startblk);
+
+	while (table_scan_getnextslot(scan, ForwardScanDirection, slot))
+	{
+#else
+	scan = heap_beginscan_strat(heapRel, SnapshotAny, 0, NULL, true, false);
+	heap_setscanlimits(scan, startblk, nblocks - startblk);
+
+	while ((tuple = heap_getnext(scan, ForwardScanDirection)) != NULL)
+	{
+		ExecStoreTuple(tuple, slot, InvalidBuffer, false);
+#endif
+		CHECK_FOR_INTERRUPTS();
+
+		ResetPerTupleExprContext(estate);
+
+		for (i = 0; i < numIndices; i++)
+		{
+			if (!merged[i])
+				continue;
+
+			if (predicates[i] != NULL && !ExecQual(predicates[i], econtext))
+				continue;
+
+			FormIndexDatum(indexInfos[i], slot, estate, values, isnull);
+#if PG_VERSION_NUM >= PG_VERSION_12
+			tuplesort_putindextuplevalues(spools[i], indices[i],
+										  &slot->tts_tid, values, isnull);
+#else
+			tuplesort_putindextuplevalues(spools[i], indices[i],
+										  &tuple->t_self, values, isnull);
+#endif
+		}
+	}
+
+#if PG_VERSION_NUM >= PG_VERSION_12
+	table_endscan(scan);
+#else
+	heap_endscan(scan);
+#endif
+
+	for (i = 0; i < numIndices; i++)
+	{
+		IndexTuple	itup;
+
+		if (!merged[i])
+			continue;
+
+		tuplesort_performsort(spools[i]);
+
+		while ((itup = tuplesort_getindextuple(spools[i], true)) != NULL)
+		{
+			MemoryContext oldcxt;
+
+			CHECK_FOR_INTERRUPTS();
+
+			ResetPerTupleExprContext(estate);
+			oldcxt = MemoryContextSwitchTo(GetPerTupleMemoryContext(estate));
+
+			index_deform_tuple(itup, RelationGetDescr(indices[i]),
+							   values, isnull);
+			index_insert(indices[i], values, isnull, &itup->t_tid, heapRel,
+						 indexInfos[i]->ii_Unique ? UNIQUE_CHECK_YES : UNIQUE_CHECK_NO,
+#if PG_VERSION_NUM >= PG_VERSION_14
+						 false,
+#endif
+						 indexInfos[i]);
+
+			MemoryContextSwitchTo(oldcxt);
+		}
+
+		tuplesort_end(spools[i]);
+	}
+
+	ExecDropSingleTupleTableSlot(slot);
+	FreeExecutorState(estate);
+	pfree(spools);
+	pfree(predicates);
+}
+
+/*
+ * Sort of the keys and row positions for a B-tree.  With unique, the sort
+ * checks the uniqueness of a unique index, as for its build; it is
+ * otherwise checked on insertion.
+ */
+static Tuplesortstate *
+begin_index_spool(Relation heapRel, Relation index, IndexInfo *indexInfo,
+				  bool unique, int workMem)
+{
+	bool		enforceUnique = unique && indexInfo->ii_Unique;
+
+#if PG_VERSION_NUM >= PG_VERSION_15
+	return tuplesort_begin_index_btree(heapRel, index, enforceUnique,
+									   indexInfo->ii_NullsNotDistinct,
+									   workMem, NULL, TUPLESORT_NONE);
+#elif PG_VERSION_NUM >= PG_VERSION_11
+	return tuplesort_begin_index_btree(heapRel, index, enforceUnique, workMem,
+									   NULL, false);
+#else
+	return tuplesort_begin_index_btree(heapRel, index, enforceUnique, workMem,
+									   false);
+#endif
+}
@@ -0,0 +1,722 @@
+/*
+ *  insert_append_io.c
+ *
+ *      This file is part of the pg_directpaths module.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2022: Bertrand Drouvot
+ *
+ */
+
+#include "include/pg_directpaths.h"
+#include "access/xlog.h"
+#include "storage/fd.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef USE_LIBURING
+#include <liburing.h>
+#endif
+#include "include/insert_append_io.h"
+
+#ifdef USE_LIBURING
+/* large enough for the requests of all the writer buffers */
+#define IA_URING_DEPTH	64
+#endif
+
+int			ia_io_method = IA_IO_METHOD_DEFAULT;
+
+const struct config_enum_entry ia_io_method_options[] = {
+	{"sync", IA_IO_METHOD_SYNC, false},
+	{"posix_aio", IA_IO_METHOD_POSIX_AIO, false},
+#ifdef USE_LIBURING
+	{"io_uring", IA_IO_METHOD_IO_URING, false},
+#endif
+	{NULL, 0, false}
+};
+
+bool		ia_direct_io = false;
+int			ia_writeback_chunks = 4;
+
+/*
+ * File ranges whose writeback has been started, oldest first.  Each entry
+ * covers the writes of one chunk to one file.
+ */
+typedef struct IAWriteback
+{
+	int			fd;
+	off_t		offset;
+	off_t		nbytes;
+} IAWriteback;
+
+static IAWriteback writebacks[IA_MAX_WRITEBACKS + 1];
+static int	nwritebacks = 0;
+
+#ifdef USE_LIBURING
+/* one ring per backend, set up on first use and kept until exit */
+static struct io_uring ring;
+static bool ring_initialized = false;
+static bool ring_failed = false;
+#endif
+
+static bool drop_direct_io(int fd);
+static void write_all(int fd, char *buf, size_t len, off_t offset);
+static void sync_file(int fd);
+static int	choose_method(IAIORequests *reqs);
+static IAIORequest *next_request(IAIORequests *reqs, int fd, char *buf,
+								 size_t len, off_t offset);
+static void posix_aio_write(IAIORequests *reqs, int fd, char *buf, size_t len,
+							off_t offset);
+static ssize_t wait_request(int method, IAIORequest *req, bool cancel);
+static void start_writeback(int fd, off_t offset, off_t nbytes, bool merge);
+static void wait_writeback(IAWriteback *wb);
+#ifdef USE_LIBURING
+static bool uring_available(void);
+static void uring_submit(bool missing_ok);
+static void uring_write(IAIORequests *reqs, int fd, char *buf, size_t len,
+						off_t offset);
+static void uring_process(struct io_uring_cqe *cqe);
+static bool uring_cancel(IAIORequest *req);
+static void uring_teardown(void);
+#endif
+
+/*
+ * Some filesystems accept O_DIRECT at open time but refuse the writes:
+ * switch the file back to buffered I/O.
+ */
+static bool
+drop_direct_io(int fd)
+{
+	int			flags;
+
+	if (IA_O_DIRECT == 0)
+		return false;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || (flags & IA_O_DIRECT) == 0)
+		return false;
+
+	if (fcntl(fd, F_SETFL, flags & ~IA_O_DIRECT) == -1)
+		return false;
+
+	ereport(LOG,
+			(errmsg("direct I/O writes refused, using buffered I/O instead")));
+
+	return true;
+}
+
+/*
+ * Synchronous write, used by the sync method and when a request can not be
+ * queued or did not complete.
+ */
+static void
+write_all(int fd, char *buf, size_t len, off_t offset)
+{
+	while (len > 0)
+	{
+		ssize_t		written = pwrite(fd, buf, len, offset);
+
+		if (written == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EINVAL && drop_direct_io(fd))
+				continue;
+			/* fatal error, do not want to write blocks anymore */
+			ereport(ERROR, (errcode_for_file_access(),
+							errmsg("could not write to file: %m")));
+		}
+		buf += written;
+		len -= written;
+		offset += written;
+	}
+}
+
+static void
+sync_file(int fd)
+{
+	if (pg_fsync(fd) != 0)
+		ereport(data_sync_elevel(ERROR),
+				(errcode_for_file_access(),
+				 errmsg("could not fsync file: %m")));
+}
+
+static IAIORequest *
+next_request(IAIORequests *reqs, int fd, char *buf, size_t len, off_t offset)
+{
+	IAIORequest *req = &reqs->reqs[reqs->count];
+
+	req->fd = fd;
+	req->buf = buf;
+	req->len = len;
+	req->offset = offset;
+	req->fsync = false;
+	req->done = false;
+	req->result = 0;
+
+	return req;
+}
+
+static void
+posix_aio_write(IAIORequests *reqs, int fd, char *buf, size_t len, off_t offset)
+{
+	if (reqs->count < IA_MAX_IO_REQUESTS)
+	{
+		IAIORequest *req = next_request(reqs, fd, buf, len, offset);
+		struct aiocb *cb = &req->cb;
+
+		MemSet(cb, 0, sizeof(struct aiocb));
+		cb->aio_fildes = fd;
+		cb->aio_buf = buf;
+		cb->aio_nbytes = len;
+		cb->aio_offset = offset;
+		cb->aio_sigevent.sigev_notify = SIGEV_NONE;
+
+		if (aio_write(cb) == 0)
+		{
+			reqs->count++;
+			return;
+		}
+	}
+
+	/* the request could not be queued (EAGAIN, ENOSYS...) */
+	write_all(fd, buf, len, offset);
+}
+
+#ifdef USE_LIBURING
+static bool
+uring_available(void)
+{
+	int			ret;
+
+	if (ring_initialized)
+		return true;
+	if (ring_failed)
+		return false;
+
+	ret = io_uring_queue_init(IA_URING_DEPTH, &ring, 0);
+	if (ret < 0)
+	{
+		/* old kernel or io_uring forbidden, stick to posix_aio */
+		ring_failed = true;
+		errno = -ret;
+		ereport(DEBUG1,
+				(errmsg("could not set up io_uring, using posix_aio instead: %m")));
+		return false;
+	}
+
+	ring_initialized = true;
+	return true;
+}
+
+static void
+uring_submit(bool missing_ok)
+{
+	int			ret;
+
+	do
+	{
+		ret = io_uring_submit(&ring);
+	} while (ret == -EINTR);
+
+	if (ret < 0 && !missing_ok)
+	{
+		errno = -ret;
+		ereport(ERROR, (errcode_for_file_access(),
+						errmsg("could not submit I/O requests: %m")));
+	}
+}
+
+/*
+ * Split the write in pieces of at least IA_IO_WRITE_SIZE so that the device
+ * gets several of them at once.  A large write uses no more than half of
+ * the requests, a buffer writing to two segments at most.
+ */
+static void
+uring_write(IAIORequests *reqs, int fd, char *buf, size_t len, off_t offset)
+{
+	size_t		piece_size = Max(IA_IO_WRITE_SIZE,
+								 TYPEALIGN(IA_IO_ALIGN,
+										   len / (IA_MAX_IO_REQUESTS / 2) + 1));
+
+	while (len > 0)
+	{
+		size_t		piece = Min(len, piece_size);
+		struct io_uring_sqe *sqe;
+		IAIORequest *req;
+
+		if (reqs->count >= IA_MAX_IO_REQUESTS)
+		{
+			write_all(fd, buf, len, offset);
+			break;
+		}
+
+		sqe = io_uring_get_sqe(&ring);
+		if (sqe == NULL)
+		{
+			/* submission queue is full, hand it over to the kernel */
+			uring_submit(false);
+			continue;
+		}
+
+		req = next_request(reqs, fd, buf, piece, offset);
+		io_uring_prep_write(sqe, fd, buf, piece, offset);
+		io_uring_sqe_set_data(sqe, req);
+		reqs->count++;
+
+		buf += piece;
+		len -= piece;
+		offset += piece;
+	}
+
+	uring_submit(false);
+}
+
+static void
+uring_process(struct io_uring_cqe *cqe)
+{
+	IAIORequest *req = (IAIORequest *) io_uring_cqe_get_data(cqe);
+
+	/* cancellations carry no request */
+	if (req != NULL)
+	{
+		req->result = cqe->res;
+		req->done = true;
+	}
+	io_uring_cqe_seen(&ring, cqe);
+}
+
+/*
+ * Ask the kernel to cancel a request in flight.  Its completion still has
+ * to be reaped.
+ */
+static bool
+uring_cancel(IAIORequest *req)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+	int			ret;
+
+	if (sqe == NULL)
+		return false;
+
+	io_uring_prep_cancel(sqe, req, 0);
+	io_uring_sqe_set_data(sqe, NULL);
+
+	do
+	{
+		ret = io_uring_submit(&ring);
+	} while (ret == -EINTR);
+
+	return ret >= 0;
+}
+
+/*
+ * Give up on a ring whose completions can not be reaped anymore.  Closing it
+ * makes the kernel cancel the requests still in flight, and none of them can
+ * be reaped afterwards: they are reported as canceled, and the next writes
+ * use posix_aio.
+ */
+static void
+uring_teardown(void)
+{
+	io_uring_queue_exit(&ring);
+	ring_initialized = false;
+	ring_failed = true;
+
+	ereport(WARNING,
+			(errmsg("could not wait for I/O completion, io_uring disabled")));
+}
+#endif
+
+/*
+ * Wait for one request to complete and return the number of bytes it wrote,
+ * 0 if it failed.
+ */
+static ssize_t
+wait_request(int method, IAIORequest *req, bool cancel)
+{
+#ifdef USE_LIBURING
+	if (method == IA_IO_METHOD_IO_URING)
+	{
+		bool		canceled = false;
+
+		while (!req->done && ring_initialized)
+		{
+			struct io_uring_cqe *cqe;
+			int			ret = io_uring_wait_cqe(&ring, &cqe);
+
+			if (ret == -EINTR)
+				continue;
+			if (ret < 0)
+			{
+				if (!cancel)
+				{
+					errno = -ret;
+					ereport(ERROR, (errcode_for_file_access(),
+									errmsg("could not wait for I/O completion: %m")));
+				}
+
+				/*
+				 * The kernel may still read the buffer of the request: it can
+				 * not be left behind for its buffer to be reused.
+				 */
+				if (!canceled && uring_cancel(req))
+					canceled = true;
+				else
+					uring_teardown();
+				continue;
+			}
+			uring_process(cqe);
+		}
+
+		/* went away with the ring */
+		if (!req->done)
+		{
+			req->result = -ECANCELED;
+			req->done = true;
+		}
+	}
+	else
+#endif
+	if (!req->done)
+	{
+		int			err;
+		ssize_t		ret;
+
+		if (cancel)
+			(void) aio_cancel(req->fd, &req->cb);
+
+		while ((err = aio_error(&req->cb)) == EINPROGRESS)
+		{
+			const struct aiocb *list[1];
+
+			list[0] = &req->cb;
+			(void) aio_suspend(list, 1, NULL);
+		}
+
+		ret = aio_return(&req->cb);
+		req->result = ret < 0 ? -err : ret;
+		req->done = true;
+	}
+
+	return Max(req->result, 0);
+}
+
+/*
+ * Ask the kernel to start writing back a range that has just been written,
+ * so that dirty data does not pile up until the fsync at close.  Once more
+ * than pg_directpaths.writeback_chunks ranges are in progress, wait for the
+ * oldest one.  merge extends the last range when contiguous, for the pieces
+ * of a same chunk.
+ */
+static void
+start_writeback(int fd, off_t offset, off_t nbytes, bool merge)
+{
+	IAWriteback *wb;
+
+	if (ia_writeback_chunks <= 0 || nbytes <= 0)
+		return;
+
+	pg_flush_data(fd, offset, nbytes);
+
+	if (merge && nwritebacks > 0)
+	{
+		wb = &writebacks[nwritebacks - 1];
+		if (wb->fd == fd && wb->offset + wb->nbytes == offset)
+		{
+			wb->nbytes += nbytes;
+			return;
+		}
+	}
+
+	wb = &writebacks[nwritebacks++];
+	wb->fd = fd;
+	wb->offset = offset;
+	wb->nbytes = nbytes;
+
+	while (nwritebacks > ia_writeback_chunks)
+	{
+		IAWriteback oldest = writebacks[0];
+
+		nwritebacks--;
+		memmove(&writebacks[0], &writebacks[1],
+				nwritebacks * sizeof(IAWriteback));
+		wait_writeback(&oldest);
+	}
+}
+
+static void
+wait_writeback(IAWriteback *wb)
+{
+#if defined(HAVE_SYNC_FILE_RANGE)
+	int			rc;
+
+	if (!enableFsync)
+		return;
+
+	do
+	{
+		rc = sync_file_range(wb->fd, wb->offset, wb->nbytes,
+							 SYNC_FILE_RANGE_WAIT_BEFORE |
+							 SYNC_FILE_RANGE_WRITE |
+							 SYNC_FILE_RANGE_WAIT_AFTER);
+	} while (rc != 0 && errno == EINTR);
+
+	/* ENOSYS and the like are not worth more than a warning */
+	if (rc != 0)
+		ereport(errno == EIO ? data_sync_elevel(ERROR) : WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not flush dirty data: %m")));
+#endif
+}
+
+/*
+ * All the requests of a set are handled by the same method.
+ */
+static int
+choose_method(IAIORequests *reqs)
+{
+	int			method = ia_io_method;
+
+#ifdef USE_LIBURING
+	/* the requests went away with the ring, finish them synchronously */
+	if (reqs->count > 0 && reqs->method == IA_IO_METHOD_IO_URING &&
+		!ring_initialized)
+		IAIOWait(reqs);
+#endif
+
+	if (reqs->count > 0)
+		method = reqs->method;
+
+#ifdef USE_LIBURING
+	if (method == IA_IO_METHOD_IO_URING && !uring_available())
+		method = IA_IO_METHOD_POSIX_AIO;
+#endif
+
+	reqs->method = method;
+
+	return method;
+}
+
+/*
+ * Write len bytes at offset, asynchronously unless the sync method is in use.
+ */
+void
+IAIOWrite(IAIORequests *reqs, int fd, char *buf, size_t len, off_t offset)
+{
+	switch (choose_method(reqs))
+	{
+		case IA_IO_METHOD_POSIX_AIO:
+			posix_aio_write(reqs, fd, buf, len, offset);
+			break;
+#ifdef USE_LIBURING
+		case IA_IO_METHOD_IO_URING:
+			uring_write(reqs, fd, buf, len, offset);
+			break;
+#endif
+		default:
+			write_all(fd, buf, len, offset);
+			start_writeback(fd, offset, len, false);
+			break;
+	}
+}
+
+/*
+ * Fsync a file whose writes are done, asynchronously unless the sync method
+ * is in use: the fsyncs of several files then run at the same time, and
+ * along with the writes to the next ones.
+ */
+void
+IAIOFsync(IAIORequests *reqs, int fd)
+{
+	int			method = choose_method(reqs);
+	IAIORequest *req;
+
+	if (!enableFsync)
+		return;
+
+	if (reqs->count < IA_MAX_IO_REQUESTS)
+	{
+		switch (method)
+		{
+			case IA_IO_METHOD_POSIX_AIO:
+				req = next_request(reqs, fd, NULL, 0, 0);
+				req->fsync = true;
+				MemSet(&req->cb, 0, sizeof(struct aiocb));
+				req->cb.aio_fildes = fd;
+				req->cb.aio_sigevent.sigev_notify = SIGEV_NONE;
+
+				if (aio_fsync(O_SYNC, &req->cb) == 0)
+				{
+					reqs->count++;
+					return;
+				}
+				break;
+#ifdef USE_LIBURING
+			case IA_IO_METHOD_IO_URING:
+				{
+					struct io_uring_sqe *sqe;
+
+					while ((sqe = io_uring_get_sqe(&ring)) == NULL)
+						uring_submit(false);
+
+					req = next_request(reqs, fd, NULL, 0, 0);
+					req->fsync = true;
+					io_uring_prep_fsync(sqe, fd, 0);
+					io_uring_sqe_set_data(sqe, req);
+					reqs->count++;
+					uring_submit(false);
+					return;
+				}
+#endif
+			default:
+				break;
+		}
+	}
+
+	sync_file(fd);
+}
+
+/*
+ * Collect the completions already available, without blocking.
+ */
+void
+IAIOReap(void)
+{
+#ifdef USE_LIBURING
+	struct io_uring_cqe *cqe;
+
+	if (!ring_initialized)
+		return;
+
+	while (io_uring_peek_cqe(&ring, &cqe) == 0 && cqe != NULL)
+		uring_process(cqe);
+#endif
+}
+
+/*
+ * Whether all the requests of reqs are done, without blocking.  IAIOWait()
+ * still has to be called to check their results.
+ */
+bool
+IAIOPoll(IAIORequests *reqs)
+{
+	int			i;
+
+	IAIOReap();
+
+	for (i = 0; i < reqs->count; i++)
+	{
+		IAIORequest *req = &reqs->reqs[i];
+
+		if (req->done)
+			continue;
+#ifdef USE_LIBURING
+		if (reqs->method == IA_IO_METHOD_IO_URING)
+			return !ring_initialized;
+#endif
+		if (aio_error(&req->cb) == EINPROGRESS)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * Wait for all the requests of reqs to be done.  A write that failed or was
+ * short is finished synchronously, which reports the error if it persists.
+ * So is an fsync that could not be run asynchronously, while a failed one
+ * is reported: retrying it could wrongly succeed.
+ */
+void
+IAIOWait(IAIORequests *reqs)
+{
+	int			i;
+
+	for (i = 0; i < reqs->count; i++)
+	{
+		IAIORequest *req = &reqs->reqs[i];
+		size_t		written = (size_t) wait_request(reqs->method, req, false);
+
+		if (req->fsync && req->result < 0)
+		{
+			int			j;
+
+			for (j = i + 1; j < reqs->count; j++)
+				(void) wait_request(reqs->method, &reqs->reqs[j], false);
+
+			if (req->result == -EINVAL || req->result == -ENOSYS ||
+				req->result == -EOPNOTSUPP || req->result == -ECANCELED)
+			{
+				sync_file(req->fd);
+				continue;
+			}
+
+			errno = -req->result;
+			ereport(data_sync_elevel(ERROR),
+					(errcode_for_file_access(),
+					 errmsg("could not fsync file: %m")));
+		}
+		else if (!req->fsync && written < req->len)
+		{
+			int			j;
+
+			/* do not leave the other requests behind if this one errors out */
+			for (j = i + 1; j < reqs->count; j++)
+				(void) wait_request(reqs->method, &reqs->reqs[j], false);
+
+			write_all(req->fd, req->buf + written, req->len - written,
+					  req->offset + written);
+		}
+	}
+
+	/* the buffer has been written, its data can go to disk */
+	for (i = 0; i < reqs->count; i++)
+	{
+		if (!reqs->reqs[i].fsync)
+			start_writeback(reqs->reqs[i].fd, reqs->reqs[i].offset,
+							reqs->reqs[i].len, i > 0);
+	}
+
+	reqs->count = 0;
+}
+
+/*
+ * Abort path: cancel what can be and wait for the rest, ignoring errors.
+ */
+void
+IAIOCancel(IAIORequests *reqs)
+{
+	int			i;
+
+#ifdef USE_LIBURING
+	/* requests may have been prepared but not submitted yet */
+	if (reqs->count > 0 && reqs->method == IA_IO_METHOD_IO_URING)
+		uring_submit(true);
+#endif
+
+	for (i = 0; i < reqs->count; i++)
+		(void) wait_request(reqs->method, &reqs->reqs[i], true);
+
+	reqs->count = 0;
+}
+
+/*
+ * Forget the writebacks of a file about to be closed.
+ */
+void
+IAIOForgetWriteback(int fd)
+{
+	int			i;
+	int			j = 0;
+
+	for (i = 0; i < nwritebacks; i++)
+	{
+		if (writebacks[i].fd != fd)
+			writebacks[j++] = writebacks[i];
+	}
+
+	nwritebacks = j;
+}
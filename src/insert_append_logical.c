@@ -0,0 +1,458 @@
+/*
+ *  insert_append_logical.c
+ *
+ *      This file is part of the pg_directpaths module.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2022: Bertrand Drouvot
+ *
+ */
+
+#include "include/pg_directpaths.h"
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "replication/logical.h"
+#include "replication/message.h"
+#include "replication/output_plugin.h"
+#include "utils/builtins.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "include/insert_append_logical.h"
+
+#if PG_VERSION_NUM >= PG_VERSION_13
+#include "access/heaptoast.h"
+#else
+#include "access/tuptoaster.h"
+#endif
+
+bool		ia_logical_messages = false;
+
+/*
+ * Output plugin: the changes as text, the rows of the direct path inserts
+ * being expanded from their logical messages into inserts.
+ */
+typedef struct IADecodingData
+{
+	MemoryContext context;	/* reset after each change */
+} IADecodingData;
+
+static void decode_startup(LogicalDecodingContext *ctx,
+						   OutputPluginOptions *opt, bool is_init);
+static void decode_shutdown(LogicalDecodingContext *ctx);
+static void decode_begin(LogicalDecodingContext *ctx, ReorderBufferTXN *txn);
+static void decode_commit(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+						  XLogRecPtr commit_lsn);
+static void decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+						  Relation relation, ReorderBufferChange *change);
+static void decode_message(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+						   XLogRecPtr message_lsn, bool transactional,
+						   const char *prefix, Size message_size,
+						   const char *message);
+static void expand_rows(LogicalDecodingContext *ctx, const char *message,
+						Size message_size);
+static void append_relation(StringInfo s, Relation relation);
+static void print_literal(StringInfo s, Oid typid, char *outputstr);
+static void tuple_to_stringinfo(StringInfo s, TupleDesc tupdesc,
+								HeapTuple tuple, bool skip_nulls);
+
+/*
+ * Start a batch of rows for the relation relid, living in mcxt.
+ */
+IALogicalBatch *
+IALogicalStart(Oid relid, MemoryContext mcxt)
+{
+	IALogicalBatch *batch;
+	MemoryContext oldcxt = MemoryContextSwitchTo(mcxt);
+
+	batch = palloc0(sizeof(IALogicalBatch));
+	batch->relid = relid;
+	initStringInfo(&batch->data);
+	appendStringInfoSpaces(&batch->data, sizeof(IALogicalRows));
+
+	MemoryContextSwitchTo(oldcxt);
+
+	return batch;
+}
+
+/*
+ * Add a row to the batch, emitting it once large enough.  tuple is the row
+ * before toasting, its external values are fetched so that the decoding
+ * does not depend on them.
+ */
+void
+IALogicalAddRow(IALogicalBatch *batch, HeapTuple tuple, TupleDesc tupdesc)
+{
+	IALogicalTuple ltup;
+
+	if (HeapTupleHasExternal(tuple))
+		tuple = toast_flatten_tuple(tuple, tupdesc);
+
+	ltup.t_len = tuple->t_len;
+	ltup.t_infomask2 = tuple->t_data->t_infomask2;
+	ltup.t_infomask = tuple->t_data->t_infomask;
+	ltup.t_hoff = tuple->t_data->t_hoff;
+
+	appendBinaryStringInfo(&batch->data, (char *) &ltup, SizeOfIALogicalTuple);
+	appendBinaryStringInfo(&batch->data,
+						   (char *) tuple->t_data + SizeofHeapTupleHeader,
+						   tuple->t_len - SizeofHeapTupleHeader);
+	batch->ntuples++;
+
+	if (batch->data.len >= IA_LOGICAL_BATCH_SIZE)
+		IALogicalFlush(batch);
+}
+
+/*
+ * Emit the rows of the batch as a transactional logical message, decoded
+ * once the transaction commits.
+ */
+void
+IALogicalFlush(IALogicalBatch *batch)
+{
+	IALogicalRows hdr;
+
+	if (batch->ntuples == 0)
+		return;
+
+	hdr.relid = batch->relid;
+	hdr.ntuples = batch->ntuples;
+	memcpy(batch->data.data, &hdr, sizeof(IALogicalRows));
+
+	LogLogicalMessage(IA_LOGICAL_PREFIX, batch->data.data, batch->data.len,
+					  true);
+
+	batch->ntuples = 0;
+	batch->data.len = sizeof(IALogicalRows);
+}
+
+void
+_PG_output_plugin_init(OutputPluginCallbacks *cb)
+{
+	AssertVariableIsOfType(&_PG_output_plugin_init, LogicalOutputPluginInit);
+
+	cb->startup_cb = decode_startup;
+	cb->begin_cb = decode_begin;
+	cb->change_cb = decode_change;
+	cb->commit_cb = decode_commit;
+	cb->message_cb = decode_message;
+	cb->shutdown_cb = decode_shutdown;
+}
+
+static void
+decode_startup(LogicalDecodingContext *ctx, OutputPluginOptions *opt,
+			   bool is_init)
+{
+	IADecodingData *data;
+	ListCell   *option;
+
+	data = palloc0(sizeof(IADecodingData));
+	data->context = AllocSetContextCreate(ctx->context,
+										  "pg_directpaths decoding context",
+										  ALLOCSET_DEFAULT_SIZES);
+	ctx->output_plugin_private = data;
+
+	opt->output_type = OUTPUT_PLUGIN_TEXTUAL_OUTPUT;
+
+	foreach(option, ctx->output_plugin_options)
+	{
+		DefElem    *elem = lfirst(option);
+
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("option \"%s\" is unknown", elem->defname)));
+	}
+}
+
+static void
+decode_shutdown(LogicalDecodingContext *ctx)
+{
+	IADecodingData *data = ctx->output_plugin_private;
+
+	MemoryContextDelete(data->context);
+}
+
+static void
+decode_begin(LogicalDecodingContext *ctx, ReorderBufferTXN *txn)
+{
+	OutputPluginPrepareWrite(ctx, true);
+	appendStringInfoString(ctx->out, "BEGIN");
+	OutputPluginWrite(ctx, true);
+}
+
+static void
+decode_commit(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+			  XLogRecPtr commit_lsn)
+{
+	OutputPluginPrepareWrite(ctx, true);
+	appendStringInfoString(ctx->out, "COMMIT");
+	OutputPluginWrite(ctx, true);
+}
+
+static void
+decode_change(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+			  Relation relation, ReorderBufferChange *change)
+{
+	IADecodingData *data = ctx->output_plugin_private;
+	TupleDesc	tupdesc = RelationGetDescr(relation);
+	MemoryContext oldcxt = MemoryContextSwitchTo(data->context);
+
+	OutputPluginPrepareWrite(ctx, true);
+	append_relation(ctx->out, relation);
+
+	switch (change->action)
+	{
+		case REORDER_BUFFER_CHANGE_INSERT:
+			appendStringInfoString(ctx->out, " INSERT:");
+			if (change->data.tp.newtuple == NULL)
+				appendStringInfoString(ctx->out, " (no-tuple-data)");
+			else
+				tuple_to_stringinfo(ctx->out, tupdesc,
+									&change->data.tp.newtuple->tuple, false);
+			break;
+		case REORDER_BUFFER_CHANGE_UPDATE:
+			appendStringInfoString(ctx->out, " UPDATE:");
+			if (change->data.tp.oldtuple != NULL)
+			{
+				appendStringInfoString(ctx->out, " old-key:");
+				tuple_to_stringinfo(ctx->out, tupdesc,
+									&change->data.tp.oldtuple->tuple, true);
+				appendStringInfoString(ctx->out, " new-tuple:");
+			}
+			if (change->data.tp.newtuple == NULL)
+				appendStringInfoString(ctx->out, " (no-tuple-data)");
+			else
+				tuple_to_stringinfo(ctx->out, tupdesc,
+									&change->data.tp.newtuple->tuple, false);
+			break;
+		case REORDER_BUFFER_CHANGE_DELETE:
+			appendStringInfoString(ctx->out, " DELETE:");
+			if (change->data.tp.oldtuple == NULL)
+				appendStringInfoString(ctx->out, " (no-tuple-data)");
+			else
+				tuple_to_stringinfo(ctx->out, tupdesc,
+									&change->data.tp.oldtuple->tuple, true);
+			break;
+		default:
+			Assert(false);
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+	MemoryContextReset(data->context);
+
+	OutputPluginWrite(ctx, true);
+}
+
+static void
+decode_message(LogicalDecodingContext *ctx, ReorderBufferTXN *txn,
+			   XLogRecPtr message_lsn, bool transactional,
+			   const char *prefix, Size message_size, const char *message)
+{
+	if (transactional && strcmp(prefix, IA_LOGICAL_PREFIX) == 0)
+	{
+		expand_rows(ctx, message, message_size);
+		return;
+	}
+
+	OutputPluginPrepareWrite(ctx, true);
+	appendStringInfo(ctx->out, "message: transactional: %d prefix: %s, sz: %zu content:",
+					 transactional, prefix, message_size);
+	appendBinaryStringInfo(ctx->out, message, message_size);
+	OutputPluginWrite(ctx, true);
+}
+
+/*
+ * Output the rows of a direct path insert message as inserts, the way the
+ * regular ones are.
+ */
+static void
+expand_rows(LogicalDecodingContext *ctx, const char *message,
+			Size message_size)
+{
+	IADecodingData *data = ctx->output_plugin_private;
+	IALogicalRows hdr;
+	Relation	relation;
+	TupleDesc	tupdesc;
+	const char *src = message + sizeof(IALogicalRows);
+	uint32		i;
+
+	if (message_size < sizeof(IALogicalRows))
+		elog(ERROR, "invalid pg_directpaths logical message size %zu",
+			 message_size);
+
+	memcpy(&hdr, message, sizeof(IALogicalRows));
+
+	relation = RelationIdGetRelation(hdr.relid);
+	if (!RelationIsValid(relation))
+		elog(ERROR, "could not open relation with OID %u", hdr.relid);
+	tupdesc = RelationGetDescr(relation);
+
+	for (i = 0; i < hdr.ntuples; i++)
+	{
+		MemoryContext oldcxt = MemoryContextSwitchTo(data->context);
+		IALogicalTuple ltup;
+		HeapTupleData tuple;
+
+		memcpy(&ltup, src, SizeOfIALogicalTuple);
+		src += SizeOfIALogicalTuple;
+
+		tuple.t_len = ltup.t_len;
+		ItemPointerSetInvalid(&tuple.t_self);
+		tuple.t_tableOid = hdr.relid;
+		tuple.t_data = (HeapTupleHeader) palloc0(ltup.t_len);
+		memcpy((char *) tuple.t_data + SizeofHeapTupleHeader, src,
+			   ltup.t_len - SizeofHeapTupleHeader);
+		src += ltup.t_len - SizeofHeapTupleHeader;
+		tuple.t_data->t_infomask2 = ltup.t_infomask2;
+		tuple.t_data->t_infomask = ltup.t_infomask;
+		tuple.t_data->t_hoff = ltup.t_hoff;
+
+		OutputPluginPrepareWrite(ctx, true);
+		append_relation(ctx->out, relation);
+		appendStringInfoString(ctx->out, " INSERT:");
+		tuple_to_stringinfo(ctx->out, tupdesc, &tuple, false);
+
+		MemoryContextSwitchTo(oldcxt);
+		MemoryContextReset(data->context);
+
+		OutputPluginWrite(ctx, true);
+	}
+
+	RelationClose(relation);
+}
+
+static void
+append_relation(StringInfo s, Relation relation)
+{
+	appendStringInfoString(s, "table ");
+	appendStringInfoString(s,
+						   quote_qualified_identifier(get_namespace_name(RelationGetNamespace(relation)),
+													  RelationGetRelationName(relation)));
+	appendStringInfoChar(s, ':');
+}
+
+/*
+ * Copy of PostgreSQL core test_decoding print_literal()
+ */
+static void
+print_literal(StringInfo s, Oid typid, char *outputstr)
+{
+	const char *valptr;
+
+	switch (typid)
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+		case OIDOID:
+		case FLOAT4OID:
+		case FLOAT8OID:
+		case NUMERICOID:
+			/* NB: We don't care about Inf, NaN et al. */
+			appendStringInfoString(s, outputstr);
+			break;
+
+		case BITOID:
+		case VARBITOID:
+			appendStringInfo(s, "B'%s'", outputstr);
+			break;
+
+		case BOOLOID:
+			if (strcmp(outputstr, "t") == 0)
+				appendStringInfoString(s, "true");
+			else
+				appendStringInfoString(s, "false");
+			break;
+
+		default:
+			appendStringInfoChar(s, '\'');
+			for (valptr = outputstr; *valptr; valptr++)
+			{
+				char		ch = *valptr;
+
+				if (SQL_STR_DOUBLE(ch, false))
+					appendStringInfoChar(s, ch);
+				appendStringInfoChar(s, ch);
+			}
+			appendStringInfoChar(s, '\'');
+			break;
+	}
+}
+
+/*
+ * Copy of PostgreSQL core test_decoding tuple_to_stringinfo()
+ */
+static void
+tuple_to_stringinfo(StringInfo s, TupleDesc tupdesc, HeapTuple tuple, bool skip_nulls)
+{
+	int			natt;
+
+	/* print all columns individually */
+	for (natt = 0; natt < tupdesc->natts; natt++)
+	{
+		Form_pg_attribute attr; /* the attribute itself */
+		Oid			typid;		/* type of current attribute */
+		Oid			typoutput;	/* output function */
+		bool		typisvarlena;
+		Datum		origval;	/* possibly toasted Datum */
+		bool		isnull;		/* column is null? */
+
+		attr = TupleDescAttr(tupdesc, natt);
+
+		/*
+		 * don't print dropped columns, we can't be sure everything is
+		 * available for them
+		 */
+		if (attr->attisdropped)
+			continue;
+
+		/*
+		 * Don't print system columns, oid will already have been printed if
+		 * present.
+		 */
+		if (attr->attnum < 0)
+			continue;
+
+		typid = attr->atttypid;
+
+		/* get Datum from tuple */
+		origval = heap_getattr(tuple, natt + 1, tupdesc, &isnull);
+
+		if (isnull && skip_nulls)
+			continue;
+
+		/* print attribute name */
+		appendStringInfoChar(s, ' ');
+		appendStringInfoString(s, quote_identifier(NameStr(attr->attname)));
+
+		/* print attribute type */
+		appendStringInfoChar(s, '[');
+		appendStringInfoString(s, format_type_be(typid));
+		appendStringInfoChar(s, ']');
+
+		/* query output function */
+		getTypeOutputInfo(typid,
+						  &typoutput, &typisvarlena);
+
+		/* print separator */
+		appendStringInfoChar(s, ':');
+
+		/* print data */
+		if (isnull)
+			appendStringInfoString(s, "null");
+		else if (typisvarlena && VARATT_IS_EXTERNAL_ONDISK(origval))
+			appendStringInfoString(s, "unchanged-toast-datum");
+		else if (!typisvarlena)
+			print_literal(s, typid,
+						  OidOutputFunctionCall(typoutput, origval));
+		else
+		{
+			Datum		val;	/* definitely detoasted Datum */
+
+			val = PointerGetDatum(PG_DETOAST_DATUM(origval));
+			print_literal(s, typid, OidOutputFunctionCall(typoutput, val));
+		}
+	}
+}
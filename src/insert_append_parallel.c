@@ -0,0 +1,657 @@
+/*
+ *  insert_append_parallel.c
+ *
+ *      This file is part of the pg_directpaths module.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2022: Bertrand Drouvot
+ *
+ */
+
+#include "include/pg_directpaths.h"
+#include "access/heapam.h"
+#include "access/parallel.h"
+#include "catalog/pg_type.h"
+#include "executor/executor.h"
+#include "nodes/makefuncs.h"
+#include "optimizer/planner.h"
+#include "parser/parsetree.h"
+#include "postmaster/bgworker_internals.h"
+#include "storage/dsm.h"
+#include "storage/dsm_impl.h"
+#include "storage/shm_toc.h"
+#include "tcop/dest.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "include/hooks.h"
+#include "include/insert_append.h"
+#include "include/insert_append_parallel.h"
+
+#if PG_VERSION_NUM >= PG_VERSION_13
+#include "access/heaptoast.h"
+#include "access/table.h"
+#else
+#include "access/tuptoaster.h"
+#endif
+
+#if PG_VERSION_NUM >= PG_VERSION_13
+#define standard_planner_compat(a, c, d) standard_planner(a, NULL, c, d)
+#else
+#define standard_planner_compat(a, c, d) standard_planner(a, c, d)
+#endif
+
+/*
+ * Header of the segment shared by the leader with the parallel workers.
+ */
+typedef struct IAParallelShared
+{
+	IAWriterParams params;	/* relation the rows go to */
+	TransactionId xid;		/* of the leader, stamped on the rows */
+	CommandId	cid;
+	pg_atomic_uint32 next_block;	/* first block not reserved yet */
+	pg_atomic_uint64 processed;	/* rows stored by the workers */
+} IAParallelShared;
+
+struct IAParallel
+{
+	dsm_segment *seg;		/* NULL once detached */
+	IAParallelShared *shared;
+	Oid			relid;
+};
+
+/*
+ * What the Insert Append Worker nodes find in the parallel query segment:
+ * whether they store the rows, and where the insert segment is.
+ */
+typedef struct IAWorkerCoordinate
+{
+	bool		store;
+	dsm_handle	handle;
+} IAWorkerCoordinate;
+
+typedef struct IAWorkerScanState
+{
+	CustomScanState css;
+	Oid			relid;		/* relation of the insert */
+	dsm_segment *seg;		/* insert segment, NULL when passing the rows */
+	IAParallelShared *shared;
+	InsertAppendWriter *writer;	/* NULL once closed */
+	uint64		processed;	/* rows stored by this worker */
+} IAWorkerScanState;
+
+struct IASource
+{
+	QueryDesc  *qd;
+	bool		parallel;	/* parallel mode entered for it */
+};
+
+/* parallel insert the Gather of the leader starts the workers for */
+static IAParallel *active_parallel = NULL;
+
+static Node *IAWorkerCreateScanState(CustomScan *cscan);
+static void IAWorkerBeginScan(CustomScanState *node, EState *estate, int eflags);
+static TupleTableSlot *IAWorkerExecScan(CustomScanState *node);
+static void IAWorkerEndScan(CustomScanState *node);
+static void IAWorkerReScan(CustomScanState *node);
+static Size IAWorkerEstimateDSM(CustomScanState *node, ParallelContext *pcxt);
+static void IAWorkerInitializeDSM(CustomScanState *node, ParallelContext *pcxt,
+								  void *coordinate);
+static void IAWorkerInitializeWorker(CustomScanState *node, shm_toc *toc,
+									 void *coordinate);
+static bool add_worker_node(PlannedStmt *plan, Oid relid, int nworkers);
+static List *expand_source_tlist(List *tlist, Relation rel);
+static int	max_plan_node_id(Plan *plan);
+
+CustomScanMethods insert_append_worker_plan_methods = {
+	"Insert Append Worker",
+	IAWorkerCreateScanState
+};
+
+static CustomExecMethods IAWorkerExecMethods = {
+	.CustomName = "InsertAppendWorkerScan",
+	.BeginCustomScan = IAWorkerBeginScan,
+	.ExecCustomScan = IAWorkerExecScan,
+	.EndCustomScan = IAWorkerEndScan,
+	.ReScanCustomScan = IAWorkerReScan,
+	.EstimateDSMCustomScan = IAWorkerEstimateDSM,
+	.InitializeDSMCustomScan = IAWorkerInitializeDSM,
+	.InitializeWorkerCustomScan = IAWorkerInitializeWorker
+};
+
+/*
+ * Create the segment the writers of a parallel insert into relid reserve
+ * their blocks from.  The Gather started next hands it to its workers.
+ * Returns NULL when it could not be created, the workers then sending all
+ * the rows to the leader.
+ */
+IAParallel *
+IAParallelBegin(IAWriterParams *params, Oid relid, TransactionId xid,
+				CommandId cid, MemoryContext mcxt)
+{
+	IAParallel *parallel;
+	IAParallelShared *shared;
+	dsm_segment *seg;
+
+#if PG_VERSION_NUM < PG_VERSION_12
+	if (dynamic_shared_memory_type == DSM_IMPL_NONE)
+		return NULL;
+#endif
+
+	seg = dsm_create(sizeof(IAParallelShared), DSM_CREATE_NULL_IF_MAXSEGMENTS);
+	if (seg == NULL)
+	{
+		ereport(DEBUG1,
+				(errmsg("could not create a shared memory segment, inserting from the leader only")));
+		return NULL;
+	}
+
+	/* detached when the writer is closed or aborted */
+	dsm_pin_mapping(seg);
+
+	shared = (IAParallelShared *) dsm_segment_address(seg);
+	shared->params = *params;
+	shared->xid = xid;
+	shared->cid = cid;
+	pg_atomic_init_u32(&shared->next_block, params->blks_initial_cnt);
+	pg_atomic_init_u64(&shared->processed, 0);
+
+	parallel = MemoryContextAllocZero(mcxt, sizeof(IAParallel));
+	parallel->seg = seg;
+	parallel->shared = shared;
+	parallel->relid = relid;
+
+	active_parallel = parallel;
+
+	return parallel;
+}
+
+/*
+ * Counter of the blocks reserved by the writers.
+ */
+pg_atomic_uint32 *
+IAParallelBlocks(IAParallel *parallel)
+{
+	return &parallel->shared->next_block;
+}
+
+/*
+ * Number of rows stored by the workers, once they are done.
+ */
+uint64
+IAParallelProcessed(IAParallel *parallel)
+{
+	return pg_atomic_read_u64(&parallel->shared->processed);
+}
+
+/*
+ * Detach from the segment, the workers being gone.
+ */
+void
+IAParallelEnd(IAParallel *parallel)
+{
+	if (active_parallel == parallel)
+		active_parallel = NULL;
+
+	if (parallel->seg == NULL)
+		return;
+
+	dsm_detach(parallel->seg);
+	parallel->seg = NULL;
+}
+
+/*
+ * Plan the source query of the insert query as a SELECT, so that it may run
+ * in parallel.  With *nworkers set, it is planned for that many workers
+ * each storing the rows of their part of it, which needs a Gather on top:
+ * *nworkers is reset when there is none, the workers then only reading
+ * the rows.  Returns NULL when the source query would not run in parallel.
+ */
+PlannedStmt *
+IAParallelPlan(Query *query, const char *query_string, int cursorOptions,
+			   ParamListInfo boundParams, int *nworkers)
+{
+	PlannedStmt *plan;
+	RangeTblEntry *rte;
+	Relation	rel;
+	int			save_nestlevel = 0;
+
+	/* before PostgreSQL 11, the leader can not toast rows in parallel mode */
+#if PG_VERSION_NUM < PG_VERSION_11
+	return NULL;
+#endif
+
+	if (!(cursorOptions & CURSOR_OPT_PARALLEL_OK) ||
+		query->commandType != CMD_INSERT || query->onConflict != NULL ||
+		query->returningList != NIL || query->hasModifyingCTE)
+		return NULL;
+
+	rte = rt_fetch(query->resultRelation, query->rtable);
+#if PG_VERSION_NUM >= PG_VERSION_13
+	rel = table_open(rte->relid, NoLock);
+#else
+	rel = heap_open(rte->relid, NoLock);
+#endif
+
+	/* the rows of the workers can not be given oids */
+#if PG_VERSION_NUM < PG_VERSION_12
+	if (rel->rd_rel->relhasoids)
+		*nworkers = 0;
+#endif
+
+	query->targetList = expand_source_tlist(query->targetList, rel);
+	query->commandType = CMD_SELECT;
+	query->resultRelation = 0;
+	/* not to be reported as another run of the insert */
+	query->queryId = UINT64CONST(0);
+
+#if PG_VERSION_NUM >= PG_VERSION_13
+	table_close(rel, NoLock);
+#else
+	heap_close(rel, NoLock);
+#endif
+
+	/*
+	 * The rows do not go through the tuple queues of the Gather, but for
+	 * the ones the leader stores.
+	 */
+	if (*nworkers > 0)
+	{
+		char		value[16];
+
+		*nworkers = Min(*nworkers, MAX_PARALLEL_WORKER_LIMIT);
+
+		save_nestlevel = NewGUCNestLevel();
+		snprintf(value, sizeof(value), "%d", *nworkers);
+		(void) set_config_option("max_parallel_workers_per_gather", value,
+								 PGC_USERSET, PGC_S_SESSION,
+								 GUC_ACTION_SAVE, true, 0, false);
+		(void) set_config_option("parallel_tuple_cost", "0",
+								 PGC_USERSET, PGC_S_SESSION,
+								 GUC_ACTION_SAVE, true, 0, false);
+	}
+
+	/* the other planner hooks apply to it, as to the insert */
+	if (prev_planner_hook)
+		plan = (*prev_planner_hook) (query,
+#if PG_VERSION_NUM >= PG_VERSION_13
+									 query_string,
+#endif
+									 cursorOptions, boundParams);
+	else
+		plan = standard_planner_compat(query, cursorOptions, boundParams);
+
+	if (*nworkers > 0)
+		AtEOXact_GUC(false, save_nestlevel);
+
+	/* the plan of the insert does as well */
+	if (!plan->parallelModeNeeded)
+		return NULL;
+
+	if (*nworkers > 0 && !add_worker_node(plan, rte->relid, *nworkers))
+		*nworkers = 0;
+
+	return plan;
+}
+
+/*
+ * Put an Insert Append Worker node for relid below the Gather on top of
+ * plan, asking for nworkers workers.  Returns false when there is no such
+ * Gather.
+ */
+static bool
+add_worker_node(PlannedStmt *plan, Oid relid, int nworkers)
+{
+	Gather	   *gather;
+	Plan	   *child;
+	CustomScan *cscan;
+	List	   *tlist = NIL;
+	ListCell   *lc;
+	AttrNumber	attno = 1;
+	int			max_id;
+
+	if (!IsA(plan->planTree, Gather))
+		return false;
+
+	gather = (Gather *) plan->planTree;
+	child = outerPlan(gather);
+	if (gather->num_workers <= 0 || gather->single_copy ||
+		list_length(gather->plan.targetlist) != list_length(child->targetlist))
+		return false;
+
+	/* the workers store the rows of the Gather child, it must not project */
+	foreach(lc, gather->plan.targetlist)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+		Var		   *var = (Var *) tle->expr;
+
+		if (!IsA(var, Var) || var->varno != OUTER_VAR ||
+			var->varattno != attno++)
+			return false;
+	}
+
+	max_id = max_plan_node_id(plan->planTree);
+	foreach(lc, plan->subplans)
+		max_id = Max(max_id, max_plan_node_id((Plan *) lfirst(lc)));
+
+	cscan = makeNode(CustomScan);
+	cscan->scan.plan.startup_cost = child->startup_cost;
+	cscan->scan.plan.total_cost = child->total_cost;
+	cscan->scan.plan.plan_rows = child->plan_rows;
+	cscan->scan.plan.plan_width = child->plan_width;
+	cscan->scan.plan.parallel_aware = true;
+	cscan->scan.plan.parallel_safe = true;
+	cscan->scan.plan.plan_node_id = max_id + 1;
+	cscan->scan.scanrelid = 0;
+	cscan->flags = 0;
+	cscan->custom_plans = list_make1(child);
+	cscan->custom_private = list_make1_oid(relid);
+	cscan->methods = &insert_append_worker_plan_methods;
+
+	/* the rows of the child go through unchanged */
+	foreach(lc, child->targetlist)
+	{
+		TargetEntry *tle = (TargetEntry *) lfirst(lc);
+
+		cscan->custom_scan_tlist =
+			lappend(cscan->custom_scan_tlist,
+					makeTargetEntry((Expr *) makeVarFromTargetEntry(OUTER_VAR, tle),
+									tle->resno, tle->resname, false));
+		tlist = lappend(tlist,
+						makeTargetEntry((Expr *) makeVarFromTargetEntry(INDEX_VAR, tle),
+										tle->resno, tle->resname, false));
+	}
+	cscan->scan.plan.targetlist = tlist;
+
+	gather->num_workers = nworkers;
+	outerPlan(gather) = (Plan *) cscan;
+
+	return true;
+}
+
+/*
+ * Target list of the source query: the one of the insert, with a null for
+ * each column it does not set, as the planner does for an insert.
+ */
+static List *
+expand_source_tlist(List *tlist, Relation rel)
+{
+	List	   *result = NIL;
+	int			attno;
+
+	for (attno = 1; attno <= RelationGetNumberOfAttributes(rel); attno++)
+	{
+		Form_pg_attribute att = TupleDescAttr(RelationGetDescr(rel), attno - 1);
+		TargetEntry *tle = NULL;
+		ListCell   *lc;
+
+		foreach(lc, tlist)
+		{
+			if (((TargetEntry *) lfirst(lc))->resno == attno)
+			{
+				tle = (TargetEntry *) lfirst(lc);
+				break;
+			}
+		}
+
+		if (tle == NULL)
+		{
+			Const	   *null;
+
+			if (att->attisdropped)
+				null = makeNullConst(INT4OID, -1, InvalidOid);
+			else
+				null = makeNullConst(att->atttypid, att->atttypmod,
+									 att->attcollation);
+			tle = makeTargetEntry((Expr *) null, attno,
+								  pstrdup(NameStr(att->attname)), false);
+		}
+
+		result = lappend(result, tle);
+	}
+
+	return result;
+}
+
+/*
+ * Highest plan node id of a plan tree, the ids of its nodes being used as
+ * keys of the parallel query segment.
+ */
+static int
+max_plan_node_id(Plan *plan)
+{
+	List	   *children = NIL;
+	ListCell   *lc;
+	int			max_id;
+
+	if (plan == NULL)
+		return -1;
+
+	max_id = plan->plan_node_id;
+	max_id = Max(max_id, max_plan_node_id(plan->lefttree));
+	max_id = Max(max_id, max_plan_node_id(plan->righttree));
+
+	switch (nodeTag(plan))
+	{
+		case T_Append:
+			children = ((Append *) plan)->appendplans;
+			break;
+		case T_MergeAppend:
+			children = ((MergeAppend *) plan)->mergeplans;
+			break;
+		case T_BitmapAnd:
+			children = ((BitmapAnd *) plan)->bitmapplans;
+			break;
+		case T_BitmapOr:
+			children = ((BitmapOr *) plan)->bitmapplans;
+			break;
+		case T_SubqueryScan:
+			children = list_make1(((SubqueryScan *) plan)->subplan);
+			break;
+		case T_CustomScan:
+			children = ((CustomScan *) plan)->custom_plans;
+			break;
+		default:
+			break;
+	}
+
+	foreach(lc, children)
+		max_id = Max(max_id, max_plan_node_id((Plan *) lfirst(lc)));
+
+	return max_id;
+}
+
+static Node *
+IAWorkerCreateScanState(CustomScan *cscan)
+{
+	IAWorkerScanState *state = palloc0(sizeof(IAWorkerScanState));
+
+	NodeSetTag(state, T_CustomScanState);
+	state->css.methods = &IAWorkerExecMethods;
+	state->relid = linitial_oid(cscan->custom_private);
+
+	return (Node *) state;
+}
+
+static void
+IAWorkerBeginScan(CustomScanState *node, EState *estate, int eflags)
+{
+	CustomScan *cscan = (CustomScan *) node->ss.ps.plan;
+
+	node->custom_ps = list_make1(ExecInitNode(linitial(cscan->custom_plans),
+											  estate, eflags));
+}
+
+/*
+ * Store the rows of the child in a worker, but for the ones that need to
+ * be toasted or hold external values of another relation: they go to the
+ * leader, as all the rows of the leader do.
+ */
+static TupleTableSlot *
+IAWorkerExecScan(CustomScanState *node)
+{
+	IAWorkerScanState *state = (IAWorkerScanState *) node;
+	PlanState  *child = (PlanState *) linitial(node->custom_ps);
+	ExprContext *econtext = node->ss.ps.ps_ExprContext;
+
+	for (;;)
+	{
+		TupleTableSlot *slot;
+		MemoryContext oldcxt;
+		HeapTuple	tuple;
+
+		CHECK_FOR_INTERRUPTS();
+
+		slot = ExecProcNode(child);
+
+		if (TupIsNull(slot))
+		{
+			if (state->writer != NULL)
+			{
+				IAWriterClose(state->writer);
+				state->writer = NULL;
+				pg_atomic_fetch_add_u64(&state->shared->processed,
+										state->processed);
+			}
+			return NULL;
+		}
+
+		if (state->writer == NULL)
+			return slot;
+
+		ResetExprContext(econtext);
+		oldcxt = MemoryContextSwitchTo(econtext->ecxt_per_tuple_memory);
+#if PG_VERSION_NUM >= PG_VERSION_12
+		tuple = ExecCopySlotHeapTuple(slot);
+#else
+		tuple = ExecCopySlotTuple(slot);
+#endif
+		MemoryContextSwitchTo(oldcxt);
+
+		/* as heap_prepare_insert(), values toasted elsewhere included */
+		if (HeapTupleHasExternal(tuple) || tuple->t_len > TOAST_TUPLE_THRESHOLD)
+			return slot;
+
+		IAWriterInsert(state->writer, tuple);
+		state->processed++;
+	}
+}
+
+static void
+IAWorkerEndScan(CustomScanState *node)
+{
+	IAWorkerScanState *state = (IAWorkerScanState *) node;
+
+	ExecEndNode((PlanState *) linitial(node->custom_ps));
+
+	if (state->seg != NULL)
+		dsm_detach(state->seg);
+}
+
+static void
+IAWorkerReScan(CustomScanState *node)
+{
+	elog(ERROR, "IAWorkerReScan is not implemented");
+}
+
+static Size
+IAWorkerEstimateDSM(CustomScanState *node, ParallelContext *pcxt)
+{
+	return sizeof(IAWorkerCoordinate);
+}
+
+/*
+ * Tell the workers where to store the rows, if the leader inserts in
+ * parallel.
+ */
+static void
+IAWorkerInitializeDSM(CustomScanState *node, ParallelContext *pcxt,
+					  void *coordinate)
+{
+	IAWorkerScanState *state = (IAWorkerScanState *) node;
+	IAWorkerCoordinate *coord = (IAWorkerCoordinate *) coordinate;
+
+	coord->store = active_parallel != NULL &&
+		active_parallel->seg != NULL &&
+		active_parallel->relid == state->relid;
+	coord->handle = coord->store ? dsm_segment_handle(active_parallel->seg) : 0;
+}
+
+/*
+ * Open the writer of a worker, or leave it passing the rows to the leader.
+ */
+static void
+IAWorkerInitializeWorker(CustomScanState *node, shm_toc *toc,
+						 void *coordinate)
+{
+	IAWorkerScanState *state = (IAWorkerScanState *) node;
+	IAWorkerCoordinate *coord = (IAWorkerCoordinate *) coordinate;
+
+	if (!coord->store)
+		return;
+
+	/* detached with the resource owner of the query, on error too */
+	state->seg = dsm_attach(coord->handle);
+	if (state->seg == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+				 errmsg("could not map the pg_directpaths parallel insert segment")));
+
+	state->shared = (IAParallelShared *) dsm_segment_address(state->seg);
+	state->writer = IAWriterOpen(&state->shared->params,
+								 state->shared->xid, state->shared->cid,
+								 &state->shared->next_block);
+}
+
+/*
+ * Start the source query, within the executor state of the insert.  The
+ * transaction id must already be assigned, it can not be once in parallel
+ * mode.
+ */
+IASource *
+IASourceStart(PlannedStmt *plan, EState *estate)
+{
+	IASource   *source = palloc0(sizeof(IASource));
+
+	source->qd = CreateQueryDesc(plan, estate->es_sourceText,
+								 estate->es_snapshot, InvalidSnapshot,
+								 None_Receiver, estate->es_param_list_info,
+								 estate->es_queryEnv, 0);
+	ExecutorStart(source->qd, 0);
+
+	/* as ExecutePlan() does */
+	source->parallel = plan->parallelModeNeeded;
+	source->qd->estate->es_use_parallel_mode = source->parallel;
+	if (source->parallel)
+		EnterParallelMode();
+
+	return source;
+}
+
+/*
+ * Get the next row of the source query, NULL once done.
+ */
+TupleTableSlot *
+IASourceNext(IASource *source)
+{
+	return ExecProcNode(source->qd->planstate);
+}
+
+/*
+ * Wait for the workers of the source query to be done and end it.
+ */
+void
+IASourceEnd(IASource *source)
+{
+	ExecShutdownNode(source->qd->planstate);
+
+	if (source->parallel)
+		ExitParallelMode();
+
+	ExecutorFinish(source->qd);
+	ExecutorEnd(source->qd);
+	FreeQueryDesc(source->qd);
+	pfree(source);
+}
@@ -0,0 +1,385 @@
+/*
+ *  insert_append_pipeline.c
+ *
+ *      This file is part of the pg_directpaths module.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2022: Bertrand Drouvot
+ *
+ */
+
+#include "include/pg_directpaths.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/dsm_impl.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/spin.h"
+#include "utils/memutils.h"
+#include "include/insert_append.h"
+#include "include/insert_append_buffers.h"
+#include "include/insert_append_io.h"
+#include "include/insert_append_pipeline.h"
+#include "include/insert_append_throttle.h"
+#include "include/insert_append_walworkers.h"
+#include "include/insert_append_xlog.h"
+
+/* size of the queue the rows go through */
+#define IA_PIPELINE_QUEUE_SIZE	(16 * 1024 * 1024)
+
+/* the rows are sent by messages of about that size */
+#define IA_PIPELINE_MESSAGE_SIZE	(64 * 1024)
+
+#if PG_VERSION_NUM >= PG_VERSION_15
+#define IAShmMqSend(mqh, nbytes, data)	shm_mq_send(mqh, nbytes, data, false, true)
+#else
+#define IAShmMqSend(mqh, nbytes, data)	shm_mq_send(mqh, nbytes, data, false)
+#endif
+
+/*
+ * Header of the shared memory segment, followed by the queue.
+ */
+typedef struct IAPipelineShared
+{
+	slock_t		mutex;		/* protects done and nblocks */
+	PGPROC	   *leader;		/* backend running the direct path insert */
+	IAWriterParams params;	/* relation the rows go to */
+	int			io_method;	/* settings of the leader */
+	bool		direct_io;
+	int			writeback_chunks;
+	bool		preallocate;
+	int			max_buffer_size;
+	int			huge_pages;
+	int			buffer_pool_size;
+	int			wal_compression;
+	bool		wal_row_images;
+	bool		direct_redo;
+	int			wal_workers;
+	int			max_wal_rate;
+	int			max_write_rate;
+	int			max_replication_lag;
+	int			replication_lag_timeout;
+	Size		queue_offset;	/* where the queue starts */
+	bool		done;		/* all the rows written */
+	BlockNumber	nblocks;	/* number of blocks appended */
+} IAPipelineShared;
+
+/*
+ * A message holds rows one after the other, each one being its length
+ * followed by its bytes.  An empty message ends the rows.
+ */
+struct IAPipeline
+{
+	dsm_segment *seg;		/* NULL once detached */
+	IAPipelineShared *shared;
+	shm_mq_handle *mqh;
+	BackgroundWorkerHandle *handle;	/* of the page builder, for the leader */
+	StringInfoData batch;	/* rows not sent yet, for the leader */
+	char	   *data;		/* message received, for the page builder */
+	Size		nbytes;		/* its size */
+	Size		offset;		/* next row in it */
+};
+
+bool		ia_pipeline = false;
+
+static void send_batch(IAPipeline *pipe);
+
+/*
+ * Create the segment holding the queue and start the page builder.
+ * Returns NULL when it could not be started, the leader then writing the
+ * rows itself.
+ */
+IAPipeline *
+IAPipelineStart(IAWriterParams *params, MemoryContext mcxt)
+{
+	IAPipeline *pipe;
+	IAPipelineShared *shared;
+	dsm_segment *seg;
+	shm_mq	   *mq;
+	Size		offset;
+	BackgroundWorker worker;
+	BackgroundWorkerHandle *handle;
+	MemoryContext oldcxt;
+
+#if PG_VERSION_NUM < PG_VERSION_12
+	if (dynamic_shared_memory_type == DSM_IMPL_NONE)
+		return NULL;
+#endif
+
+	offset = MAXALIGN(sizeof(IAPipelineShared));
+
+	seg = dsm_create(add_size(offset, IA_PIPELINE_QUEUE_SIZE),
+					 DSM_CREATE_NULL_IF_MAXSEGMENTS);
+	if (seg == NULL)
+	{
+		ereport(DEBUG1,
+				(errmsg("could not create a shared memory segment, inserting without pipeline")));
+		return NULL;
+	}
+
+	/* detached when the writer is closed or aborted */
+	dsm_pin_mapping(seg);
+
+	shared = (IAPipelineShared *) dsm_segment_address(seg);
+	MemSet(shared, 0, offset);
+	SpinLockInit(&shared->mutex);
+	shared->leader = MyProc;
+	shared->params = *params;
+	shared->io_method = ia_io_method;
+	shared->direct_io = ia_direct_io;
+	shared->writeback_chunks = ia_writeback_chunks;
+	shared->preallocate = ia_preallocate;
+	shared->max_buffer_size = ia_max_buffer_size;
+	shared->huge_pages = ia_huge_pages;
+	shared->buffer_pool_size = ia_buffer_pool_size;
+	shared->wal_compression = ia_wal_compression;
+	shared->wal_row_images = ia_wal_row_images;
+	shared->direct_redo = ia_direct_redo;
+	shared->wal_workers = ia_wal_workers;
+	shared->max_wal_rate = ia_max_wal_rate;
+	shared->max_write_rate = ia_max_write_rate;
+	shared->max_replication_lag = ia_max_replication_lag;
+	shared->replication_lag_timeout = ia_replication_lag_timeout;
+	shared->queue_offset = offset;
+
+	mq = shm_mq_create((char *) shared + offset, IA_PIPELINE_QUEUE_SIZE);
+	shm_mq_set_sender(mq, MyProc);
+
+	MemSet(&worker, 0, sizeof(BackgroundWorker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_ConsistentState;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_directpaths");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "IAPipelineWorkerMain");
+	snprintf(worker.bgw_name, BGW_MAXLEN,
+			 "pg_directpaths page builder for PID %d", MyProcPid);
+#if PG_VERSION_NUM >= PG_VERSION_11
+	snprintf(worker.bgw_type, BGW_MAXLEN, "pg_directpaths page builder");
+#endif
+	worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+	worker.bgw_notify_pid = MyProcPid;
+
+	oldcxt = MemoryContextSwitchTo(mcxt);
+
+	if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+	{
+		MemoryContextSwitchTo(oldcxt);
+		ereport(DEBUG1,
+				(errmsg("could not start the page builder, inserting without pipeline")));
+		dsm_detach(seg);
+		return NULL;
+	}
+
+	pipe = palloc0(sizeof(IAPipeline));
+	pipe->seg = seg;
+	pipe->shared = shared;
+	pipe->handle = handle;
+	/* the sends fail if the page builder exits before attaching */
+	pipe->mqh = shm_mq_attach(mq, seg, handle);
+	initStringInfo(&pipe->batch);
+
+	MemoryContextSwitchTo(oldcxt);
+
+	return pipe;
+}
+
+/*
+ * Send the rows batched so far.
+ */
+static void
+send_batch(IAPipeline *pipe)
+{
+	if (IAShmMqSend(pipe->mqh, pipe->batch.len, pipe->batch.data) != SHM_MQ_SUCCESS)
+		ereport(ERROR,
+				(errmsg("pg_directpaths page builder exited before writing the rows"),
+				 errhint("More details may be available in the server log.")));
+
+	resetStringInfo(&pipe->batch);
+}
+
+/*
+ * Queue a row to be stored, its header being complete but for its ctid.
+ * Blocks while the queue is full.
+ */
+void
+IAPipelineSend(IAPipeline *pipe, Item item, uint32 len)
+{
+	if (pipe->batch.len > 0 &&
+		pipe->batch.len + sizeof(uint32) + len > IA_PIPELINE_MESSAGE_SIZE)
+		send_batch(pipe);
+
+	appendBinaryStringInfo(&pipe->batch, (char *) &len, sizeof(uint32));
+	appendBinaryStringInfo(&pipe->batch, (char *) item, len);
+}
+
+/*
+ * Send the last rows and wait for the page builder to be done with them:
+ * their pages are then written as when the leader writes them.  Returns the
+ * number of blocks appended to the relation.
+ */
+BlockNumber
+IAPipelineFinish(IAPipeline *pipe)
+{
+	IAPipelineShared *shared = pipe->shared;
+	BlockNumber nblocks;
+
+	if (pipe->batch.len > 0)
+		send_batch(pipe);
+
+	/* an empty message ends the rows */
+	send_batch(pipe);
+
+	for (;;)
+	{
+		bool		done;
+		pid_t		pid;
+		int			rc;
+
+		SpinLockAcquire(&shared->mutex);
+		done = shared->done;
+		nblocks = shared->nblocks;
+		SpinLockRelease(&shared->mutex);
+
+		if (done)
+			break;
+
+		if (GetBackgroundWorkerPid(pipe->handle, &pid) == BGWH_STOPPED)
+			ereport(ERROR,
+					(errmsg("pg_directpaths page builder exited before writing the rows"),
+					 errhint("More details may be available in the server log.")));
+
+		/* the latch is set by the page builder once done, or on exit */
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | IA_WL_EXIT,
+					   1000L, PG_WAIT_EXTENSION);
+#if PG_VERSION_NUM < PG_VERSION_12
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+#else
+		(void) rc;
+#endif
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	dsm_detach(pipe->seg);
+	pipe->seg = NULL;
+
+	return nblocks;
+}
+
+/*
+ * Stop the page builder and detach from the segment, on abort.  Its writes
+ * must be over before the lock on the relation is released, so wait for
+ * it to exit.
+ */
+void
+IAPipelineStop(IAPipeline *pipe)
+{
+	if (pipe->seg == NULL)
+		return;
+
+	TerminateBackgroundWorker(pipe->handle);
+	WaitForBackgroundWorkerShutdown(pipe->handle);
+
+	dsm_detach(pipe->seg);
+	pipe->seg = NULL;
+}
+
+/*
+ * Attach the page builder to the segment, taking the settings of the
+ * leader.  Returns NULL when the leader is already gone.
+ */
+IAPipeline *
+IAPipelineAttach(Datum main_arg, IAWriterParams *params)
+{
+	IAPipeline *pipe;
+	IAPipelineShared *shared;
+	dsm_segment *seg;
+	shm_mq	   *mq;
+
+	/* without a resource owner, the mapping lasts until exit */
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		return NULL;
+
+	shared = (IAPipelineShared *) dsm_segment_address(seg);
+
+	ia_io_method = shared->io_method;
+	ia_direct_io = shared->direct_io;
+	ia_writeback_chunks = shared->writeback_chunks;
+	ia_preallocate = shared->preallocate;
+	ia_max_buffer_size = shared->max_buffer_size;
+	ia_huge_pages = shared->huge_pages;
+	ia_buffer_pool_size = shared->buffer_pool_size;
+	ia_wal_compression = shared->wal_compression;
+	ia_wal_row_images = shared->wal_row_images;
+	ia_direct_redo = shared->direct_redo;
+	ia_wal_workers = shared->wal_workers;
+	ia_max_wal_rate = shared->max_wal_rate;
+	ia_max_write_rate = shared->max_write_rate;
+	ia_max_replication_lag = shared->max_replication_lag;
+	ia_replication_lag_timeout = shared->replication_lag_timeout;
+	*params = shared->params;
+
+	mq = (shm_mq *) ((char *) shared + shared->queue_offset);
+	shm_mq_set_receiver(mq, MyProc);
+
+	pipe = MemoryContextAllocZero(TopMemoryContext, sizeof(IAPipeline));
+	pipe->seg = seg;
+	pipe->shared = shared;
+	pipe->mqh = shm_mq_attach(mq, seg, NULL);
+
+	return pipe;
+}
+
+/*
+ * Get the next row to store, valid until the next call.  Returns false
+ * once all the rows have been received.  Exits when the leader is gone.
+ */
+bool
+IAPipelineReceive(IAPipeline *pipe, Item *item, uint32 *len)
+{
+	if (pipe->offset >= pipe->nbytes)
+	{
+		void	   *data;
+
+		if (shm_mq_receive(pipe->mqh, &pipe->nbytes, &data, false) != SHM_MQ_SUCCESS)
+			proc_exit(0);		/* the leader aborted and stops us */
+
+		if (pipe->nbytes == 0)
+			return false;
+
+		pipe->data = data;
+		pipe->offset = 0;
+	}
+
+	memcpy(len, pipe->data + pipe->offset, sizeof(uint32));
+	*item = (Item) (pipe->data + pipe->offset + sizeof(uint32));
+	pipe->offset += sizeof(uint32) + *len;
+
+	return true;
+}
+
+/*
+ * Let the leader know that the pages of all the rows are written.
+ */
+void
+IAPipelineDone(IAPipeline *pipe, BlockNumber nblocks)
+{
+	IAPipelineShared *shared = pipe->shared;
+
+	SpinLockAcquire(&shared->mutex);
+	shared->done = true;
+	shared->nblocks = nblocks;
+	SpinLockRelease(&shared->mutex);
+
+	SetLatch(&shared->leader->procLatch);
+}
@@ -0,0 +1,221 @@
+/*
+ *  insert_append_throttle.c
+ *
+ *      This file is part of the pg_directpaths module.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2022: Bertrand Drouvot
+ *
+ */
+
+#include <math.h>
+#include "include/pg_directpaths.h"
+#include "access/xlog.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "replication/walsender.h"
+#include "replication/walsender_private.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/spin.h"
+#include "utils/timestamp.h"
+#include "include/insert_append_throttle.h"
+
+/* a bucket holds up to that much of its rate */
+#define IA_THROTTLE_BURST_MS	1000
+
+/* how often the replication lag is checked again while backing off */
+#define IA_LAG_CHECK_MS			100
+
+/*
+ * Token bucket: the bytes written are taken out of it, and it is refilled
+ * at the configured rate.  The writer sleeps while it is in debt.
+ */
+typedef struct IABucket
+{
+	double		tokens;		/* bytes that can be written, may be negative */
+	TimestampTz	last;		/* last refill */
+} IABucket;
+
+int			ia_max_wal_rate = 0;
+int			ia_max_write_rate = 0;
+int			ia_max_replication_lag = 0;
+int			ia_replication_lag_timeout = 60000;
+
+static IABucket wal_bucket;
+static IABucket write_bucket;
+
+/* the standbys kept the writer waiting too long, it goes on without them */
+static bool lag_timed_out;
+
+static void sleep_ms(long msec);
+static long take_tokens(IABucket *bucket, int rate, uint64 bytes,
+						TimestampTz now);
+static uint64 replication_lag(void);
+static void wait_replication_lag(void);
+
+/*
+ * Fill up the buckets, for a new writer.
+ */
+void
+IAThrottleStart(void)
+{
+	TimestampTz now = GetCurrentTimestamp();
+
+	wal_bucket.tokens = (double) ia_max_wal_rate * 1024 * 1024 *
+		IA_THROTTLE_BURST_MS / 1000;
+	wal_bucket.last = now;
+	write_bucket.tokens = (double) ia_max_write_rate * 1024 * 1024 *
+		IA_THROTTLE_BURST_MS / 1000;
+	write_bucket.last = now;
+	lag_timed_out = false;
+}
+
+static void
+sleep_ms(long msec)
+{
+	TimestampTz end = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), msec);
+
+	for (;;)
+	{
+		long		secs;
+		int			usecs;
+		long		remaining;
+		int			rc;
+
+		TimestampDifference(GetCurrentTimestamp(), end, &secs, &usecs);
+		remaining = secs * 1000 + usecs / 1000;
+		if (remaining <= 0)
+			break;
+
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | IA_WL_EXIT,
+					   remaining, PG_WAIT_EXTENSION);
+#if PG_VERSION_NUM < PG_VERSION_12
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+#else
+		(void) rc;
+#endif
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+}
+
+/*
+ * Refill the bucket for the time elapsed and take bytes out of it.  Returns
+ * how long to sleep for the debt to be paid back, in milliseconds.
+ */
+static long
+take_tokens(IABucket *bucket, int rate, uint64 bytes, TimestampTz now)
+{
+	double		bytes_per_ms = (double) rate * 1024 * 1024 / 1000;
+
+	bucket->tokens = Min(bucket->tokens +
+						 bytes_per_ms * (now - bucket->last) / 1000.0,
+						 bytes_per_ms * IA_THROTTLE_BURST_MS);
+	bucket->last = now;
+	bucket->tokens -= bytes;
+
+	if (bucket->tokens >= 0)
+		return 0;
+
+	return (long) ceil(-bucket->tokens / bytes_per_ms);
+}
+
+/*
+ * How far the slowest streaming standby is behind the WAL inserted so far,
+ * 0 without any.
+ */
+static uint64
+replication_lag(void)
+{
+	XLogRecPtr	insert = GetXLogInsertRecPtr();
+	XLogRecPtr	slowest = InvalidXLogRecPtr;
+	int			i;
+
+	if (WalSndCtl == NULL)
+		return 0;
+
+	for (i = 0; i < max_wal_senders; i++)
+	{
+		WalSnd	   *walsnd = &WalSndCtl->walsnds[i];
+		pid_t		pid;
+		WalSndState state;
+		XLogRecPtr	apply;
+
+		SpinLockAcquire(&walsnd->mutex);
+		pid = walsnd->pid;
+		state = walsnd->state;
+		apply = walsnd->apply;
+		SpinLockRelease(&walsnd->mutex);
+
+		if (pid == 0 || state != WALSNDSTATE_STREAMING ||
+			XLogRecPtrIsInvalid(apply))
+			continue;
+
+		if (XLogRecPtrIsInvalid(slowest) || apply < slowest)
+			slowest = apply;
+	}
+
+	if (XLogRecPtrIsInvalid(slowest) || slowest >= insert)
+		return 0;
+
+	return insert - slowest;
+}
+
+/*
+ * Wait for the slowest standby to be no more than max_replication_lag
+ * behind, for up to pg_directpaths.replication_lag_timeout.  A standby that
+ * does not catch up by then, stalled or not replaying anymore, is not
+ * waited for again during the load.
+ */
+static void
+wait_replication_lag(void)
+{
+	TimestampTz start = GetCurrentTimestamp();
+
+	while (replication_lag() > (uint64) ia_max_replication_lag * 1024)
+	{
+		if (ia_replication_lag_timeout > 0 &&
+			TimestampDifferenceExceeds(start, GetCurrentTimestamp(),
+									   ia_replication_lag_timeout))
+		{
+			lag_timed_out = true;
+			ereport(WARNING,
+					(errmsg("standbys did not catch up with the direct path insert within %d ms",
+							ia_replication_lag_timeout),
+					 errdetail("The insert goes on without waiting for them anymore.")));
+			break;
+		}
+
+		sleep_ms(IA_LAG_CHECK_MS);
+	}
+}
+
+/*
+ * Called by the writer once a chunk has been handed over: keep the WAL and
+ * write rates within pg_directpaths.max_wal_rate and max_write_rate, then
+ * wait for the standbys to replay enough of the WAL when they are more than
+ * pg_directpaths.max_replication_lag behind.  The writes in flight go on
+ * meanwhile.
+ */
+void
+IAThrottle(uint64 wal_bytes, uint64 write_bytes)
+{
+	TimestampTz now = GetCurrentTimestamp();
+	long		delay = 0;
+
+	if (ia_max_wal_rate > 0)
+		delay = take_tokens(&wal_bucket, ia_max_wal_rate, wal_bytes, now);
+	if (ia_max_write_rate > 0)
+		delay = Max(delay, take_tokens(&write_bucket, ia_max_write_rate,
+									   write_bytes, now));
+
+	if (delay > 0)
+		sleep_ms(delay);
+
+	if (ia_max_replication_lag > 0 && !lag_timed_out)
+		wait_replication_lag();
+}
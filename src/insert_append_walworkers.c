@@ -0,0 +1,449 @@
+/*
+ *  insert_append_walworkers.c
+ *
+ *      This file is part of the pg_directpaths module.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2022: Bertrand Drouvot
+ *
+ */
+
+#include "include/pg_directpaths.h"
+#include "access/xlog.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/dsm.h"
+#include "storage/dsm_impl.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/spin.h"
+#include "utils/memutils.h"
+#include "include/insert_append_io.h"
+#include "include/insert_append_walworkers.h"
+#include "include/insert_append_xlog.h"
+
+/* a chunk is not split in smaller parts than that */
+#define IA_WAL_WORKER_MIN_PAGES	64
+
+/*
+ * Part of a chunk handed to a worker.  requested and done count the parts
+ * handed and logged, the worker having one part at most to log.
+ */
+typedef struct IAWalWorkerSlot
+{
+	PGPROC	   *proc;		/* set once the worker is ready */
+	uint64		requested;
+	uint64		done;
+	int			buf;		/* buffer holding the pages */
+	int			start;		/* first page in the buffer */
+	int			num;		/* number of pages */
+	BlockNumber	blkno;		/* block number of the first page */
+	uint64		wal_bytes;	/* WAL written, not collected yet */
+} IAWalWorkerSlot;
+
+/*
+ * Header of the shared memory segment, followed by the writer buffers.
+ */
+typedef struct IAWalShared
+{
+	slock_t		mutex;		/* protects the slots */
+	PGPROC	   *leader;		/* backend running the direct path insert */
+	RelFileNode	node;		/* relation the pages belong to */
+	int			wal_compression;	/* settings of the leader */
+	bool		wal_row_images;
+	bool		direct_redo;
+	Size		buffers_offset;	/* where the buffers start */
+	Size		buffer_size;	/* size of each buffer */
+	IAWalWorkerSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} IAWalShared;
+
+struct IAWalWorkers
+{
+	dsm_segment *seg;
+	IAWalShared *shared;
+	int			nworkers;
+	BackgroundWorkerHandle *handles[IA_MAX_WAL_WORKERS];
+};
+
+int			ia_wal_workers = 0;
+
+static volatile sig_atomic_t got_sigterm = false;
+
+static void worker_sigterm(SIGNAL_ARGS);
+
+/*
+ * Create the segment holding nbuffers buffers of buffer_size bytes and start
+ * the workers.  Returns NULL when no worker could be started, the caller
+ * then logging the pages itself.
+ */
+IAWalWorkers *
+IAWalWorkersStart(RelFileNode node, int nbuffers, Size buffer_size,
+				  MemoryContext mcxt)
+{
+	IAWalWorkers *workers;
+	IAWalShared *shared;
+	dsm_segment *seg;
+	Size		offset;
+	MemoryContext oldcxt;
+	int			i;
+
+	if (ia_wal_workers <= 0)
+		return NULL;
+
+#if PG_VERSION_NUM < PG_VERSION_12
+	if (dynamic_shared_memory_type == DSM_IMPL_NONE)
+		return NULL;
+#endif
+
+	/* the buffers are aligned as needed by direct I/O */
+	offset = TYPEALIGN(IA_IO_ALIGN,
+					   add_size(offsetof(IAWalShared, slots),
+								mul_size(ia_wal_workers, sizeof(IAWalWorkerSlot))));
+
+	seg = dsm_create(add_size(offset, mul_size(nbuffers, buffer_size)),
+					 DSM_CREATE_NULL_IF_MAXSEGMENTS);
+	if (seg == NULL)
+	{
+		ereport(DEBUG1,
+				(errmsg("could not create a shared memory segment, WAL-logging without workers")));
+		return NULL;
+	}
+
+	/* detached when the writer is closed or aborted */
+	dsm_pin_mapping(seg);
+
+	shared = (IAWalShared *) dsm_segment_address(seg);
+	MemSet(shared, 0, offset);
+	SpinLockInit(&shared->mutex);
+	shared->leader = MyProc;
+	shared->node = node;
+	shared->wal_compression = ia_wal_compression;
+	shared->wal_row_images = ia_wal_row_images;
+	shared->direct_redo = ia_direct_redo;
+	shared->buffers_offset = offset;
+	shared->buffer_size = buffer_size;
+
+	oldcxt = MemoryContextSwitchTo(mcxt);
+
+	workers = palloc0(sizeof(IAWalWorkers));
+	workers->seg = seg;
+	workers->shared = shared;
+
+	for (i = 0; i < ia_wal_workers; i++)
+	{
+		BackgroundWorker worker;
+
+		MemSet(&worker, 0, sizeof(BackgroundWorker));
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+			BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_ConsistentState;
+		worker.bgw_restart_time = BGW_NEVER_RESTART;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_directpaths");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "IAWalWorkerMain");
+		snprintf(worker.bgw_name, BGW_MAXLEN,
+				 "pg_directpaths WAL worker for PID %d", MyProcPid);
+#if PG_VERSION_NUM >= PG_VERSION_11
+		snprintf(worker.bgw_type, BGW_MAXLEN, "pg_directpaths WAL worker");
+#endif
+		worker.bgw_main_arg = UInt32GetDatum(dsm_segment_handle(seg));
+		worker.bgw_notify_pid = MyProcPid;
+		memcpy(worker.bgw_extra, &i, sizeof(int));
+
+		/* out of background worker slots, do with the ones started */
+		if (!RegisterDynamicBackgroundWorker(&worker, &workers->handles[i]))
+			break;
+
+		workers->nworkers++;
+	}
+
+	MemoryContextSwitchTo(oldcxt);
+
+	if (workers->nworkers == 0)
+	{
+		ereport(DEBUG1,
+				(errmsg("could not start any WAL worker, WAL-logging without workers")));
+		dsm_detach(seg);
+		pfree(workers);
+		return NULL;
+	}
+
+	return workers;
+}
+
+/*
+ * Memory of a writer buffer, in the shared memory segment.
+ */
+char *
+IAWalWorkersBuffer(IAWalWorkers *workers, int buf)
+{
+	IAWalShared *shared = workers->shared;
+
+	return (char *) shared + shared->buffers_offset +
+		(Size) buf * shared->buffer_size;
+}
+
+/*
+ * Hand the WAL-logging and checksums of the num first pages of a buffer
+ * over to the workers, split in consecutive parts.  The pages must not be
+ * modified until IAWalWorkersWait() returned.
+ */
+void
+IAWalWorkersLog(IAWalWorkers *workers, int buf, int num, BlockNumber blkno)
+{
+	IAWalShared *shared = workers->shared;
+	int			per_worker;
+	int			start;
+	int			i;
+
+	per_worker = Max((num + workers->nworkers - 1) / workers->nworkers,
+					 IA_WAL_WORKER_MIN_PAGES);
+
+	for (i = 0, start = 0; start < num; i++, start += per_worker)
+	{
+		IAWalWorkerSlot *slot = &shared->slots[i];
+		PGPROC	   *proc;
+
+		SpinLockAcquire(&shared->mutex);
+		Assert(slot->done == slot->requested);
+		slot->buf = buf;
+		slot->start = start;
+		slot->num = Min(per_worker, num - start);
+		slot->blkno = blkno + start;
+		slot->requested++;
+		proc = slot->proc;
+		SpinLockRelease(&shared->mutex);
+
+		/* a worker not ready yet checks its slot once it is */
+		if (proc != NULL)
+			SetLatch(&proc->procLatch);
+	}
+}
+
+/*
+ * Whether the workers are done with the pages handed over, without
+ * blocking.  IAWalWorkersWait() still has to be called to collect them.
+ */
+bool
+IAWalWorkersDone(IAWalWorkers *workers)
+{
+	IAWalShared *shared = workers->shared;
+	bool		done = true;
+	int			i;
+
+	SpinLockAcquire(&shared->mutex);
+	for (i = 0; i < workers->nworkers; i++)
+	{
+		if (shared->slots[i].done != shared->slots[i].requested)
+		{
+			done = false;
+			break;
+		}
+	}
+	SpinLockRelease(&shared->mutex);
+
+	return done;
+}
+
+/*
+ * Wait for the workers to be done with the pages handed over.  Returns the
+ * number of WAL bytes they wrote for them.
+ */
+uint64
+IAWalWorkersWait(IAWalWorkers *workers)
+{
+	IAWalShared *shared = workers->shared;
+	uint64		wal_bytes = 0;
+	int			i;
+
+	for (;;)
+	{
+		int			pending = -1;
+		pid_t		pid;
+		int			rc;
+
+		SpinLockAcquire(&shared->mutex);
+		for (i = 0; i < workers->nworkers; i++)
+		{
+			if (shared->slots[i].done != shared->slots[i].requested)
+			{
+				pending = i;
+				break;
+			}
+		}
+		SpinLockRelease(&shared->mutex);
+
+		if (pending == -1)
+			break;
+
+		if (GetBackgroundWorkerPid(workers->handles[pending], &pid) == BGWH_STOPPED)
+			ereport(ERROR,
+					(errmsg("pg_directpaths WAL worker exited before logging the pages"),
+					 errhint("More details may be available in the server log.")));
+
+		/* the latch is set by the workers as they are done, or exit */
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | IA_WL_EXIT,
+					   1000L, PG_WAIT_EXTENSION);
+#if PG_VERSION_NUM < PG_VERSION_12
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+#else
+		(void) rc;
+#endif
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+
+	SpinLockAcquire(&shared->mutex);
+	for (i = 0; i < workers->nworkers; i++)
+	{
+		wal_bytes += shared->slots[i].wal_bytes;
+		shared->slots[i].wal_bytes = 0;
+	}
+	SpinLockRelease(&shared->mutex);
+
+	return wal_bytes;
+}
+
+/*
+ * Stop the workers and detach from the segment, also on abort: the parts
+ * in progress are still logged, without harm.
+ */
+void
+IAWalWorkersStop(IAWalWorkers *workers)
+{
+	int			i;
+
+	for (i = 0; i < workers->nworkers; i++)
+		TerminateBackgroundWorker(workers->handles[i]);
+
+	dsm_detach(workers->seg);
+	workers->nworkers = 0;
+}
+
+static void
+worker_sigterm(SIGNAL_ARGS)
+{
+	int			save_errno = errno;
+
+	got_sigterm = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Entry point of the WAL workers: log the parts of the chunks handed over
+ * by the leader, until it stops them.
+ */
+void
+IAWalWorkerMain(Datum main_arg)
+{
+	dsm_segment *seg;
+	IAWalShared *shared;
+	IAWalWorkerSlot *slot;
+	int			slotno;
+	int			maxpages;
+	Page	   *pages;
+	BlockNumber *blknos;
+	uint64		done = 0;
+
+	pqsignal(SIGTERM, worker_sigterm);
+	BackgroundWorkerUnblockSignals();
+
+	memcpy(&slotno, MyBgworkerEntry->bgw_extra, sizeof(int));
+
+	/* no database is needed to insert WAL */
+#if PG_VERSION_NUM >= PG_VERSION_11
+	BackgroundWorkerInitializeConnectionByOid(InvalidOid, InvalidOid, 0);
+#else
+	BackgroundWorkerInitializeConnectionByOid(InvalidOid, InvalidOid);
+#endif
+
+	/* without a resource owner, the mapping lasts until exit */
+	seg = dsm_attach(DatumGetUInt32(main_arg));
+	if (seg == NULL)
+		proc_exit(0);			/* the leader is already done */
+
+	shared = (IAWalShared *) dsm_segment_address(seg);
+	slot = &shared->slots[slotno];
+
+	maxpages = shared->buffer_size / BLCKSZ;
+	pages = MemoryContextAlloc(TopMemoryContext, maxpages * sizeof(Page));
+	blknos = MemoryContextAlloc(TopMemoryContext, maxpages * sizeof(BlockNumber));
+
+	ia_wal_compression = shared->wal_compression;
+	ia_wal_row_images = shared->wal_row_images;
+	ia_direct_redo = shared->direct_redo;
+
+	SpinLockAcquire(&shared->mutex);
+	slot->proc = MyProc;
+	SpinLockRelease(&shared->mutex);
+
+	while (!got_sigterm)
+	{
+		uint64		requested;
+		int			buf;
+		int			start;
+		int			num;
+		BlockNumber	blkno;
+		uint64		wal_bytes;
+		int			i;
+		int			rc;
+
+		ResetLatch(MyLatch);
+
+		SpinLockAcquire(&shared->mutex);
+		requested = slot->requested;
+		buf = slot->buf;
+		start = slot->start;
+		num = slot->num;
+		blkno = slot->blkno;
+		SpinLockRelease(&shared->mutex);
+
+		if (requested != done)
+		{
+			char	   *first = (char *) shared + shared->buffers_offset +
+				(Size) buf * shared->buffer_size + (Size) BLCKSZ * start;
+
+			for (i = 0; i < num; i++)
+			{
+				pages[i] = (Page) (first + (Size) BLCKSZ * i);
+				blknos[i] = blkno + i;
+			}
+
+			wal_bytes = IAXLogNewPages(&shared->node, MAIN_FORKNUM, num,
+									   blknos, pages);
+
+			if (DataChecksumsEnabled())
+			{
+				for (i = 0; i < num; i++)
+					PageSetChecksumInplace(pages[i], blknos[i]);
+			}
+
+			done = requested;
+
+			SpinLockAcquire(&shared->mutex);
+			slot->done = done;
+			slot->wal_bytes += wal_bytes;
+			SpinLockRelease(&shared->mutex);
+
+			SetLatch(&shared->leader->procLatch);
+			continue;
+		}
+
+		rc = WaitLatch(MyLatch, WL_LATCH_SET | IA_WL_EXIT, -1L,
+					   PG_WAIT_EXTENSION);
+#if PG_VERSION_NUM < PG_VERSION_12
+		if (rc & WL_POSTMASTER_DEATH)
+			proc_exit(1);
+#else
+		(void) rc;
+#endif
+	}
+
+	proc_exit(0);
+}
@@ -0,0 +1,911 @@
+/*
+ *  insert_append_xlog.c
+ *
+ *      This file is part of the pg_directpaths module.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the LICENSE file.
+ *
+ * Copyright (C) 2022: Bertrand Drouvot
+ *
+ */
+
+#include "include/pg_directpaths.h"
+#include "miscadmin.h"
+#include "include/insert_append_xlog.h"
+
+#include "access/xlog.h"
+#include "access/xloginsert.h"
+#if PG_VERSION_NUM >= PG_VERSION_13
+#include "executor/instrument.h"
+#endif
+
+#if PG_VERSION_NUM < PG_VERSION_14
+#include "access/xlogrecord.h"
+#include "catalog/pg_control.h"
+#endif
+#if PG_VERSION_NUM >= PG_VERSION_15
+#include <fcntl.h>
+#include <unistd.h>
+#include "access/htup_details.h"
+#include "access/xlog_internal.h"
+#include "access/xlogutils.h"
+#include "common/pg_lzcompress.h"
+#include "storage/bufmgr.h"
+#include "storage/fd.h"
+#include "storage/smgr.h"
+#include "storage/sync.h"
+#include "utils/memutils.h"
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+#endif
+
+int			ia_wal_compression = IA_WAL_COMPRESSION_NONE;
+
+const struct config_enum_entry ia_wal_compression_options[] = {
+	{"off", IA_WAL_COMPRESSION_NONE, false},
+	{"pglz", IA_WAL_COMPRESSION_PGLZ, false},
+#ifdef USE_LZ4
+	{"lz4", IA_WAL_COMPRESSION_LZ4, false},
+#endif
+#ifdef USE_ZSTD
+	{"zstd", IA_WAL_COMPRESSION_ZSTD, false},
+#endif
+	{NULL, 0, false}
+};
+
+bool		ia_wal_row_images = false;
+bool		ia_direct_redo = false;
+
+#if PG_VERSION_NUM >= PG_VERSION_15
+static const RmgrData ia_rmgr = {
+	.rm_name = IA_RMGR_NAME,
+	.rm_redo = ia_xlog_redo,
+	.rm_desc = ia_xlog_desc,
+	.rm_identify = ia_xlog_identify
+};
+
+/* set when the resource manager could be registered */
+static bool rmgr_registered = false;
+
+#define IA_XLOG_RAW_SIZE	(IA_XLOG_PAGES_PER_RECORD * BLCKSZ)
+
+/* scratch buffers, allocated on first use and kept until exit */
+static uint16 *holes = NULL;
+static char *raw = NULL;
+static char *rows = NULL;
+static char *compressed = NULL;
+static int32 compressed_size = 0;
+static PGAlignedBlock tuple_buf;
+/* appended pages of the record being replayed, allocated on first redo */
+static char *redo_run = NULL;
+
+/*
+ * Block being restored.  The blocks appended to the relation can not be in
+ * the shared buffers, so they are restored in a local run of pages written
+ * directly to the relation files once the record is replayed, as on the
+ * primary.  The others, already there when a record is replayed again, go
+ * through the shared buffers.
+ */
+typedef struct IARedoTarget
+{
+	SMgrRelation reln;
+	ForkNumber	forknum;
+	BlockNumber	nblocks;	/* size of the relation fork, run included */
+	XLogRecPtr	lsn;		/* end of the record being replayed */
+	Buffer		buffer;		/* of the block, InvalidBuffer if in the run */
+	BlockNumber	runblk;		/* first block of the run */
+	int			nrun;		/* number of pages in the run */
+} IARedoTarget;
+
+static void alloc_scratch(void);
+static int32 compress_data(int method, const char *src, int32 raw_len);
+static void decompress_data(xl_ia_pages *xlrec, const char *data);
+static int32 set_holes(int npages, Page *pages);
+static void copy_pages(int npages, Page *pages);
+static int32 encode_rows(xl_ia_pages *xlrec, Page *pages, int32 limit);
+static void log_page_run(RelFileNode *rnode, ForkNumber forknum,
+						 BlockNumber *blknos, int npages, Page *pages);
+static void redo_start(IARedoTarget *target, XLogReaderState *record,
+					   xl_ia_pages *xlrec);
+static Page redo_get_page(IARedoTarget *target, xl_ia_pages *xlrec,
+						  BlockNumber blkno);
+static void redo_put_page(IARedoTarget *target, Page page, BlockNumber blkno);
+static void redo_write_run(IARedoTarget *target);
+static void redo_pages(XLogReaderState *record, xl_ia_pages *xlrec);
+static void redo_rows(XLogReaderState *record, xl_ia_pages *xlrec);
+#endif
+#if PG_VERSION_NUM < PG_VERSION_14
+static void log_newpages(RelFileNode *rnode, ForkNumber forkNum, int num_pages,
+             BlockNumber *blknos, Page *pages, bool page_std);
+#endif
+
+/*
+ * Custom resource managers can only be registered while the library is
+ * preloaded.
+ */
+void
+IAXLogInit(void)
+{
+#if PG_VERSION_NUM >= PG_VERSION_15
+	if (!process_shared_preload_libraries_in_progress)
+		return;
+
+	RegisterCustomRmgr(IA_RMGR_ID, &ia_rmgr);
+	rmgr_registered = true;
+#endif
+}
+
+/*
+ * WAL-log consecutive pages with records of the custom resource manager,
+ * as row images or compressed pages.  Returns false when that is not
+ * possible or not wanted, the caller then falling back to log_newpages().
+ */
+bool
+IAXLogPages(RelFileNode *rnode, ForkNumber forknum, int num_pages,
+			BlockNumber *blknos, Page *pages)
+{
+#if PG_VERSION_NUM >= PG_VERSION_15
+	int			i;
+
+	if ((ia_wal_compression == IA_WAL_COMPRESSION_NONE && !ia_wal_row_images &&
+		 !ia_direct_redo) || !rmgr_registered)
+		return false;
+
+	for (i = 1; i < num_pages; i++)
+	{
+		if (blknos[i] != blknos[0] + i)
+			return false;
+	}
+
+	alloc_scratch();
+
+	for (i = 0; i < num_pages; i += IA_XLOG_PAGES_PER_RECORD)
+		log_page_run(rnode, forknum, &blknos[i],
+					 Min(num_pages - i, IA_XLOG_PAGES_PER_RECORD), &pages[i]);
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * WAL-log new pages, with the records of the custom resource manager when
+ * enabled and as full page images otherwise.  Returns the number of WAL
+ * bytes written, which before PostgreSQL 13 includes the records inserted
+ * by the other backends meanwhile.
+ */
+uint64
+IAXLogNewPages(RelFileNode *rnode, ForkNumber forknum, int num_pages,
+			   BlockNumber *blknos, Page *pages)
+{
+#if PG_VERSION_NUM >= PG_VERSION_13
+	uint64		start = pgWalUsage.wal_bytes;
+#else
+	XLogRecPtr	start = GetXLogInsertRecPtr();
+#endif
+
+	if (!IAXLogPages(rnode, forknum, num_pages, blknos, pages))
+		log_newpages(rnode, forknum, num_pages, blknos, pages, true);
+
+#if PG_VERSION_NUM >= PG_VERSION_13
+	return pgWalUsage.wal_bytes - start;
+#else
+	return GetXLogInsertRecPtr() - start;
+#endif
+}
+
+#if PG_VERSION_NUM >= PG_VERSION_15
+static void
+alloc_scratch(void)
+{
+	if (raw != NULL)
+		return;
+
+	compressed_size = PGLZ_MAX_OUTPUT(IA_XLOG_RAW_SIZE);
+#ifdef USE_LZ4
+	compressed_size = Max(compressed_size, LZ4_compressBound(IA_XLOG_RAW_SIZE));
+#endif
+#ifdef USE_ZSTD
+	compressed_size = Max(compressed_size, (int32) ZSTD_compressBound(IA_XLOG_RAW_SIZE));
+#endif
+
+	holes = MemoryContextAlloc(TopMemoryContext,
+							   IA_XLOG_PAGES_PER_RECORD * 2 * sizeof(uint16));
+	compressed = MemoryContextAlloc(TopMemoryContext, compressed_size);
+	rows = MemoryContextAlloc(TopMemoryContext, IA_XLOG_RAW_SIZE);
+	raw = MemoryContextAlloc(TopMemoryContext, IA_XLOG_RAW_SIZE);
+}
+
+/*
+ * Compress the raw_len bytes of src into compressed.  Returns the
+ * compressed length, or -1 when that does not make the data smaller.
+ */
+static int32
+compress_data(int method, const char *src, int32 raw_len)
+{
+	int32		len = -1;
+
+	switch (method)
+	{
+		case IA_WAL_COMPRESSION_PGLZ:
+			len = pglz_compress(src, raw_len, compressed, PGLZ_strategy_default);
+			break;
+#ifdef USE_LZ4
+		case IA_WAL_COMPRESSION_LZ4:
+			len = LZ4_compress_default(src, compressed, raw_len, compressed_size);
+			if (len <= 0)
+				len = -1;
+			break;
+#endif
+#ifdef USE_ZSTD
+		case IA_WAL_COMPRESSION_ZSTD:
+			{
+				size_t		ret = ZSTD_compress(compressed, compressed_size,
+												src, raw_len,
+												ZSTD_CLEVEL_DEFAULT);
+
+				len = ZSTD_isError(ret) ? -1 : (int32) ret;
+				break;
+			}
+#endif
+		default:
+			break;
+	}
+
+	if (len >= raw_len)
+		return -1;
+
+	return len;
+}
+
+/*
+ * Compute the hole of each page, as for full page images, and return the
+ * length of the pages without them.
+ */
+static int32
+set_holes(int npages, Page *pages)
+{
+	int32		len = 0;
+	int			i;
+
+	for (i = 0; i < npages; i++)
+	{
+		PageHeader	phdr = (PageHeader) pages[i];
+		uint16		lower = phdr->pd_lower;
+		uint16		upper = phdr->pd_upper;
+
+		if (lower >= SizeOfPageHeaderData && upper > lower && upper <= BLCKSZ)
+		{
+			holes[2 * i] = lower;
+			holes[2 * i + 1] = upper - lower;
+		}
+		else
+		{
+			holes[2 * i] = 0;
+			holes[2 * i + 1] = 0;
+		}
+
+		len += BLCKSZ - holes[2 * i + 1];
+	}
+
+	return len;
+}
+
+/*
+ * Copy the pages without their hole into raw.
+ */
+static void
+copy_pages(int npages, Page *pages)
+{
+	char	   *dst = raw;
+	int			i;
+
+	for (i = 0; i < npages; i++)
+	{
+		uint16		hole_offset = holes[2 * i];
+		uint16		hole_length = holes[2 * i + 1];
+
+		if (hole_length == 0)
+		{
+			memcpy(dst, pages[i], BLCKSZ);
+			dst += BLCKSZ;
+		}
+		else
+		{
+			memcpy(dst, pages[i], hole_offset);
+			memcpy(dst + hole_offset, (char *) pages[i] + hole_offset + hole_length,
+				   BLCKSZ - (hole_offset + hole_length));
+			dst += BLCKSZ - hole_length;
+		}
+	}
+}
+
+/*
+ * Encode the tuples of the pages as row images into rows, provided that the
+ * pages can be rebuilt exactly from them: tuples added in order to an
+ * initialized page, all with the same xmin and cmin, without xmax and
+ * pointing to themselves, as IAExecInsert() builds them.  Returns the
+ * encoded length, or -1 when not possible or not smaller than limit.
+ */
+static int32
+encode_rows(xl_ia_pages *xlrec, Page *pages, int32 limit)
+{
+	char	   *dst = rows;
+	bool		have_template = false;
+	int			i;
+
+	for (i = 0; i < xlrec->npages; i++)
+	{
+		Page		page = pages[i];
+		PageHeader	phdr = (PageHeader) page;
+		OffsetNumber maxoff = PageGetMaxOffsetNumber(page);
+		uint16		ntuples = maxoff;
+		Size		upper = BLCKSZ;
+		OffsetNumber off;
+
+		if (phdr->pd_flags != 0 || phdr->pd_special != BLCKSZ ||
+			phdr->pd_prune_xid != InvalidTransactionId ||
+			phdr->pd_lower != SizeOfPageHeaderData + maxoff * sizeof(ItemIdData))
+			return -1;
+
+		if ((dst - rows) + sizeof(uint16) >= limit)
+			return -1;
+		memcpy(dst, &ntuples, sizeof(uint16));
+		dst += sizeof(uint16);
+
+		for (off = FirstOffsetNumber; off <= maxoff; off++)
+		{
+			ItemId		itemid = PageGetItemId(page, off);
+			HeapTupleHeader htup;
+			xl_ia_tuple xltup;
+			Size		len;
+
+			if (!ItemIdIsNormal(itemid))
+				return -1;
+
+			len = ItemIdGetLength(itemid);
+			if (len < SizeofHeapTupleHeader || MAXALIGN(len) > upper)
+				return -1;
+			upper -= MAXALIGN(len);
+			if (ItemIdGetOffset(itemid) != upper)
+				return -1;
+
+			htup = (HeapTupleHeader) PageGetItem(page, itemid);
+			if (!have_template)
+			{
+				xlrec->xmin = HeapTupleHeaderGetRawXmin(htup);
+				xlrec->cmin = HeapTupleHeaderGetRawCommandId(htup);
+				have_template = true;
+			}
+
+			if (HeapTupleHeaderGetRawXmin(htup) != xlrec->xmin ||
+				HeapTupleHeaderGetRawCommandId(htup) != xlrec->cmin ||
+				HeapTupleHeaderGetRawXmax(htup) != InvalidTransactionId ||
+				ItemPointerGetBlockNumberNoCheck(&htup->t_ctid) != xlrec->blkno + i ||
+				ItemPointerGetOffsetNumberNoCheck(&htup->t_ctid) != off ||
+				htup->t_hoff < SizeofHeapTupleHeader)
+				return -1;
+
+			if ((dst - rows) + SizeOfIATuple + (len - SizeofHeapTupleHeader) >= limit)
+				return -1;
+
+			xltup.t_len = len;
+			xltup.t_infomask2 = htup->t_infomask2;
+			xltup.t_infomask = htup->t_infomask;
+			xltup.t_hoff = htup->t_hoff;
+			memcpy(dst, &xltup, SizeOfIATuple);
+			dst += SizeOfIATuple;
+			memcpy(dst, (char *) htup + SizeofHeapTupleHeader,
+				   len - SizeofHeapTupleHeader);
+			dst += len - SizeofHeapTupleHeader;
+		}
+
+		if (phdr->pd_upper != upper)
+			return -1;
+	}
+
+	return dst - rows;
+}
+
+/*
+ * Log npages pages with a single record, as row images when enabled and
+ * smaller than the pages without their hole, as compressed pages
+ * otherwise.  Without compression, full page images are as small as the
+ * latter.
+ */
+static void
+log_page_run(RelFileNode *rnode, ForkNumber forknum, BlockNumber *blknos,
+			 int npages, Page *pages)
+{
+	xl_ia_pages xlrec;
+	uint8		info = XLOG_IA_PAGES;
+	const char *src = raw;
+	const char *data;
+	int32		len;
+	XLogRecPtr	recptr;
+	int			i;
+
+	xlrec.node = *rnode;
+	xlrec.forknum = forknum;
+	xlrec.blkno = blknos[0];
+	xlrec.xmin = InvalidTransactionId;
+	xlrec.cmin = InvalidCommandId;
+	xlrec.npages = npages;
+	xlrec.raw_len = set_holes(npages, pages);
+
+	if (ia_wal_row_images)
+	{
+		len = encode_rows(&xlrec, pages, xlrec.raw_len);
+		if (len >= 0)
+		{
+			info = XLOG_IA_ROWS;
+			xlrec.raw_len = len;
+			src = rows;
+		}
+	}
+
+	if (info == XLOG_IA_PAGES)
+	{
+		if (ia_wal_compression == IA_WAL_COMPRESSION_NONE && !ia_direct_redo)
+		{
+			log_newpages(rnode, forknum, npages, blknos, pages, true);
+			return;
+		}
+		copy_pages(npages, pages);
+	}
+
+	len = compress_data(ia_wal_compression, src, xlrec.raw_len);
+	if (len >= 0)
+	{
+		xlrec.method = ia_wal_compression;
+		xlrec.data_len = len;
+		data = compressed;
+	}
+	else
+	{
+		xlrec.method = IA_WAL_COMPRESSION_NONE;
+		xlrec.data_len = xlrec.raw_len;
+		data = src;
+	}
+
+	XLogBeginInsert();
+	XLogRegisterData((char *) &xlrec, SizeOfIAPages);
+	if (info == XLOG_IA_PAGES)
+		XLogRegisterData((char *) holes, npages * 2 * sizeof(uint16));
+	XLogRegisterData((char *) data, xlrec.data_len);
+
+	/* no block is referenced: tell pg_rewind it can not follow the record */
+	recptr = XLogInsert(IA_RMGR_ID, info | XLR_SPECIAL_REL_UPDATE);
+
+	for (i = 0; i < npages; i++)
+	{
+		if (!PageIsNew(pages[i]))
+			PageSetLSN(pages[i], recptr);
+	}
+}
+
+/*
+ * Uncompress the data of a record into raw.
+ */
+static void
+decompress_data(xl_ia_pages *xlrec, const char *data)
+{
+	int64		len = -1;
+
+	if (xlrec->raw_len > IA_XLOG_RAW_SIZE)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid pg_directpaths WAL record length %u",
+						xlrec->raw_len)));
+
+	switch (xlrec->method)
+	{
+		case IA_WAL_COMPRESSION_NONE:
+			memcpy(raw, data, xlrec->data_len);
+			len = xlrec->data_len;
+			break;
+		case IA_WAL_COMPRESSION_PGLZ:
+			len = pglz_decompress(data, xlrec->data_len, raw, xlrec->raw_len,
+								  true);
+			break;
+#ifdef USE_LZ4
+		case IA_WAL_COMPRESSION_LZ4:
+			len = LZ4_decompress_safe(data, raw, xlrec->data_len,
+									  IA_XLOG_RAW_SIZE);
+			break;
+#endif
+#ifdef USE_ZSTD
+		case IA_WAL_COMPRESSION_ZSTD:
+			{
+				size_t		ret = ZSTD_decompress(raw, IA_XLOG_RAW_SIZE,
+												  data, xlrec->data_len);
+
+				len = ZSTD_isError(ret) ? -1 : (int64) ret;
+				break;
+			}
+#endif
+		default:
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("pg_directpaths WAL record compressed with unsupported method %u",
+							xlrec->method)));
+	}
+
+	if (len != xlrec->raw_len)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("could not decompress pg_directpaths WAL record")));
+}
+
+static void
+redo_start(IARedoTarget *target, XLogReaderState *record, xl_ia_pages *xlrec)
+{
+	if (xlrec->npages > IA_XLOG_PAGES_PER_RECORD)
+		ereport(ERROR,
+				(errcode(ERRCODE_DATA_CORRUPTED),
+				 errmsg("invalid pg_directpaths WAL record page count %u",
+						xlrec->npages)));
+
+	target->reln = smgropen(xlrec->node, InvalidBackendId);
+	target->forknum = xlrec->forknum;
+
+	/* the relation may have been dropped since, as XLogReadBufferExtended() */
+	smgrcreate(target->reln, target->forknum, true);
+	target->nblocks = smgrnblocks(target->reln, target->forknum);
+	target->lsn = record->EndRecPtr;
+	target->buffer = InvalidBuffer;
+	target->runblk = target->nblocks;
+	target->nrun = 0;
+
+	if (redo_run == NULL)
+		redo_run = MemoryContextAlloc(TopMemoryContext, IA_XLOG_RAW_SIZE);
+}
+
+/*
+ * Page to restore block blkno into, zeroed or not.
+ */
+static Page
+redo_get_page(IARedoTarget *target, xl_ia_pages *xlrec, BlockNumber blkno)
+{
+	if (blkno == target->nblocks)
+	{
+		if (target->nrun == 0)
+			target->runblk = blkno;
+		target->buffer = InvalidBuffer;
+		return (Page) (redo_run + (Size) BLCKSZ * target->nrun);
+	}
+
+	/* the run would be overwritten by the zeroed blocks extending the fork */
+	redo_write_run(target);
+
+	/* extends the relation up to blkno if needed */
+	target->buffer = XLogReadBufferExtended(xlrec->node, xlrec->forknum, blkno,
+											RBM_ZERO_AND_LOCK, InvalidBuffer);
+	target->nblocks = Max(target->nblocks, blkno + 1);
+
+	return BufferGetPage(target->buffer);
+}
+
+/*
+ * Done with a restored page: add it to the run or release its buffer.
+ */
+static void
+redo_put_page(IARedoTarget *target, Page page, BlockNumber blkno)
+{
+	PageSetLSN(page, target->lsn);
+
+	if (BufferIsValid(target->buffer))
+	{
+		MarkBufferDirty(target->buffer);
+		UnlockReleaseBuffer(target->buffer);
+		return;
+	}
+
+	PageSetChecksumInplace(page, blkno);
+	target->nrun++;
+	target->nblocks++;
+}
+
+/*
+ * Write the run of appended pages with one write per segment file, and hand
+ * the fsync of each file over to the checkpointer once, where smgrextend()
+ * would have written and registered every page on its own.
+ */
+static void
+redo_write_run(IARedoTarget *target)
+{
+	RelFileNodeBackend bknode;
+	char	   *path;
+	int			i;
+
+	if (target->nrun == 0)
+		return;
+
+	/* as the buffer manager does before writing a page */
+	XLogFlush(target->lsn);
+
+	bknode = target->reln->smgr_rnode;
+	path = relpath(bknode, target->forknum);
+
+	for (i = 0; i < target->nrun;)
+	{
+		BlockNumber blkno = target->runblk + i;
+		BlockNumber segno = blkno / RELSEG_SIZE;
+		int			num = Min(target->nrun - i,
+							  RELSEG_SIZE - blkno % RELSEG_SIZE);
+		char	   *filename = path;
+		FileTag		tag;
+		ssize_t		written;
+		int			fd;
+
+		if (segno > 0)
+			filename = psprintf("%s.%u", path, segno);
+
+		fd = BasicOpenFilePerm(filename, O_CREAT | O_WRONLY | PG_BINARY,
+							   pg_file_create_mode);
+		if (fd == -1)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", filename)));
+
+		written = pg_pwrite(fd, redo_run + (Size) BLCKSZ * i,
+							(Size) BLCKSZ * num,
+							(off_t) BLCKSZ * (blkno % RELSEG_SIZE));
+		if (written != (ssize_t) BLCKSZ * num)
+		{
+			/* a short write is most likely a full disk */
+			if (written >= 0)
+				errno = ENOSPC;
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not write %d blocks from block %u in file \"%s\": %m",
+							num, blkno, filename)));
+		}
+
+		MemSet(&tag, 0, sizeof(FileTag));
+		tag.handler = SYNC_HANDLER_MD;
+		tag.forknum = target->forknum;
+		tag.rnode = bknode.node;
+		tag.segno = segno;
+
+		/* as register_dirty_segment() does */
+		if (!RegisterSyncRequest(&tag, SYNC_REQUEST, false) &&
+			pg_fsync(fd) < 0)
+			ereport(data_sync_elevel(ERROR),
+					(errcode_for_file_access(),
+					 errmsg("could not fsync file \"%s\": %m", filename)));
+
+		if (close(fd) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not close file \"%s\": %m", filename)));
+
+		if (filename != path)
+			pfree(filename);
+
+		i += num;
+	}
+
+	pfree(path);
+
+	/* the size smgr caches during recovery went stale */
+	target->reln->smgr_cached_nblocks[target->forknum] = InvalidBlockNumber;
+	target->runblk += target->nrun;
+	target->nrun = 0;
+}
+
+/*
+ * Restore the pages.
+ */
+static void
+redo_pages(XLogReaderState *record, xl_ia_pages *xlrec)
+{
+	uint16	   *recholes = (uint16 *) ((char *) xlrec + SizeOfIAPages);
+	IARedoTarget target;
+	char	   *src;
+	int			i;
+
+	decompress_data(xlrec, (char *) (recholes + 2 * xlrec->npages));
+	redo_start(&target, record, xlrec);
+
+	src = raw;
+	for (i = 0; i < xlrec->npages; i++)
+	{
+		uint16		hole_offset = recholes[2 * i];
+		uint16		hole_length = recholes[2 * i + 1];
+		Page		page;
+
+		page = redo_get_page(&target, xlrec, xlrec->blkno + i);
+
+		if (hole_length == 0)
+		{
+			memcpy(page, src, BLCKSZ);
+			src += BLCKSZ;
+		}
+		else
+		{
+			memcpy(page, src, hole_offset);
+			MemSet((char *) page + hole_offset, 0, hole_length);
+			memcpy((char *) page + hole_offset + hole_length, src + hole_offset,
+				   BLCKSZ - (hole_offset + hole_length));
+			src += BLCKSZ - hole_length;
+		}
+
+		redo_put_page(&target, page, xlrec->blkno + i);
+	}
+
+	redo_write_run(&target);
+}
+
+/*
+ * Rebuild the pages from their tuples.
+ */
+static void
+redo_rows(XLogReaderState *record, xl_ia_pages *xlrec)
+{
+	HeapTupleHeader htup = (HeapTupleHeader) tuple_buf.data;
+	IARedoTarget target;
+	char	   *src;
+	int			i;
+
+	decompress_data(xlrec, (char *) xlrec + SizeOfIAPages);
+	redo_start(&target, record, xlrec);
+
+	src = raw;
+	for (i = 0; i < xlrec->npages; i++)
+	{
+		Page		page;
+		uint16		ntuples;
+		int			t;
+
+		page = redo_get_page(&target, xlrec, xlrec->blkno + i);
+		PageInit(page, BLCKSZ, 0);
+
+		memcpy(&ntuples, src, sizeof(uint16));
+		src += sizeof(uint16);
+
+		for (t = 0; t < ntuples; t++)
+		{
+			xl_ia_tuple xltup;
+
+			memcpy(&xltup, src, SizeOfIATuple);
+			src += SizeOfIATuple;
+
+			MemSet(htup, 0, SizeofHeapTupleHeader);
+			memcpy((char *) htup + SizeofHeapTupleHeader, src,
+				   xltup.t_len - SizeofHeapTupleHeader);
+			src += xltup.t_len - SizeofHeapTupleHeader;
+
+			HeapTupleHeaderSetXmin(htup, xlrec->xmin);
+			htup->t_choice.t_heap.t_field3.t_cid = xlrec->cmin;
+			htup->t_infomask2 = xltup.t_infomask2;
+			htup->t_infomask = xltup.t_infomask;
+			htup->t_hoff = xltup.t_hoff;
+			ItemPointerSet(&htup->t_ctid, xlrec->blkno + i, t + 1);
+
+			if (PageAddItem(page, (Item) htup, xltup.t_len, InvalidOffsetNumber,
+							false, true) != t + 1)
+				elog(PANIC, "ia_xlog_redo: failed to add tuple");
+		}
+
+		redo_put_page(&target, page, xlrec->blkno + i);
+	}
+
+	redo_write_run(&target);
+}
+
+void
+ia_xlog_redo(XLogReaderState *record)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+	xl_ia_pages *xlrec = (xl_ia_pages *) XLogRecGetData(record);
+
+	alloc_scratch();
+
+	switch (info)
+	{
+		case XLOG_IA_PAGES:
+			redo_pages(record, xlrec);
+			break;
+		case XLOG_IA_ROWS:
+			redo_rows(record, xlrec);
+			break;
+		default:
+			elog(PANIC, "ia_xlog_redo: unknown op code %u", info);
+	}
+}
+
+void
+ia_xlog_desc(StringInfo buf, XLogReaderState *record)
+{
+	uint8		info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+	xl_ia_pages *xlrec = (xl_ia_pages *) XLogRecGetData(record);
+
+	if (info == XLOG_IA_PAGES || info == XLOG_IA_ROWS)
+		appendStringInfo(buf, "rel %u/%u/%u; fork %d; blk %u; pages %u; method %u; raw %u; data %u",
+						 xlrec->node.spcNode, xlrec->node.dbNode,
+						 xlrec->node.relNode, xlrec->forknum, xlrec->blkno,
+						 xlrec->npages, xlrec->method, xlrec->raw_len,
+						 xlrec->data_len);
+	if (info == XLOG_IA_ROWS)
+		appendStringInfo(buf, "; xmin %u; cmin %u", xlrec->xmin, xlrec->cmin);
+}
+
+const char *
+ia_xlog_identify(uint8 info)
+{
+	switch (info & ~XLR_INFO_MASK)
+	{
+		case XLOG_IA_PAGES:
+			return "PAGES";
+		case XLOG_IA_ROWS:
+			return "ROWS";
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Copy of PostgreSQL 14 core log_newpages()
+ */
+#if PG_VERSION_NUM < PG_VERSION_14
+static void
+log_newpages(RelFileNode *rnode, ForkNumber forkNum, int num_pages,
+             BlockNumber *blknos, Page *pages, bool page_std)
+{
+    int         flags;
+    XLogRecPtr  recptr;
+    int         i;
+    int         j;
+
+    flags = REGBUF_FORCE_IMAGE;
+    if (page_std)
+        flags |= REGBUF_STANDARD;
+
+    /*
+     * Iterate over all the pages. They are collected into batches of
+     * XLR_MAX_BLOCK_ID pages, and a single WAL-record is written for each
+     * batch.
+     */
+    XLogEnsureRecordSpace(XLR_MAX_BLOCK_ID - 1, 0);
+
+    i = 0;
+    while (i < num_pages)
+    {
+        int         batch_start = i;
+        int         nbatch;
+
+        XLogBeginInsert();
+
+        nbatch = 0;
+        while (nbatch < XLR_MAX_BLOCK_ID && i < num_pages)
+        {
+            XLogRegisterBlock(nbatch, rnode, forkNum, blknos[i], pages[i], flags);
+            i++;
+            nbatch++;
+        }
+
+        recptr = XLogInsert(RM_XLOG_ID, XLOG_FPI);
+
+        for (j = batch_start; j < i; j++)
+        {
+            /*
+             * The page may be uninitialized. If so, we can't set the LSN
+             * because that would corrupt the page.
+             */
+            if (!PageIsNew(pages[j]))
+            {
+                PageSetLSN(pages[j], recptr);
+            }
+        }
+    }
+}
+#endif
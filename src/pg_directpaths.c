@@ -17,6 +17,16 @@
 #include "include/hooks.h"
 #include "include/pg_directpaths.h"
 #include "include/cscan.h"
+#include "include/insert_append.h"
+#include "include/insert_append_buffers.h"
+#include "include/insert_append_indexes.h"
+#include "include/insert_append_io.h"
+#include "include/insert_append_logical.h"
+#include "include/insert_append_parallel.h"
+#include "include/insert_append_pipeline.h"
+#include "include/insert_append_throttle.h"
+#include "include/insert_append_walworkers.h"
+#include "include/insert_append_xlog.h"
 
 
 #ifdef PG_MODULE_MAGIC
@@ -29,14 +39,230 @@ void _PG_fini(void);
 void _PG_init(void)
 {
 	RegisterCustomScanMethods(&insert_append_plan_methods);
+	RegisterCustomScanMethods(&insert_append_worker_plan_methods);
     prev_planner_hook = planner_hook;
 	planner_hook = InsertAppend_planner;
     prev_post_parse_analyze_hook = post_parse_analyze_hook;
     post_parse_analyze_hook = InsertAppend_post_parse_analyze;
+
+	DefineCustomEnumVariable("pg_directpaths.io_method",
+							 "Selects the method used to write the direct path chunks.",
+							 NULL,
+							 &ia_io_method,
+							 IA_IO_METHOD_DEFAULT,
+							 ia_io_method_options,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_directpaths.direct_io",
+							 "Writes the direct path chunks with O_DIRECT, bypassing the OS page cache.",
+							 NULL,
+							 &ia_direct_io,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_directpaths.writeback_chunks",
+							"Number of written chunks whose writeback may be in progress before waiting for the oldest.",
+							"0 leaves the writeback to the fsync at the end of each segment.",
+							&ia_writeback_chunks,
+							4,
+							0,
+							IA_MAX_WRITEBACKS,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_directpaths.preallocate",
+							 "Preallocates the relation files space ahead of the direct path writes.",
+							 NULL,
+							 &ia_preallocate,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("pg_directpaths.sync_mode",
+							 "Selects how the relation files written by direct path inserts are synced.",
+							 NULL,
+							 &ia_sync_mode,
+							 IA_SYNC_MODE_IMMEDIATE,
+							 ia_sync_mode_options,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_directpaths.max_buffer_size",
+							"Maximum size of each of the direct path writer buffers.",
+							"The buffers start at a few blocks and double as the load grows.",
+							&ia_max_buffer_size,
+							65536,
+							(16 * BLCKSZ) / 1024,
+							(int) Min((double) RELSEG_SIZE * (BLCKSZ / 1024), (double) MAX_KILOBYTES),
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("pg_directpaths.huge_pages",
+							 "Use of huge pages for the direct path writer buffers.",
+							 NULL,
+							 &ia_huge_pages,
+							 HUGE_PAGES_TRY,
+							 ia_huge_pages_options,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_directpaths.buffer_pool_size",
+							"Maximum size of the direct path writer buffers kept by a backend for the next statements.",
+							"0 releases the buffers at the end of each statement.",
+							&ia_buffer_pool_size,
+							131072,
+							0,
+							MAX_KILOBYTES,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("pg_directpaths.wal_compression",
+							 "Compresses the WAL of the pages written by direct path inserts.",
+							 "Needs the library in shared_preload_libraries, on the standbys too.",
+							 &ia_wal_compression,
+							 IA_WAL_COMPRESSION_NONE,
+							 ia_wal_compression_options,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_directpaths.wal_row_images",
+							 "WAL-logs the pages written by direct path inserts as the rows they hold when smaller.",
+							 "Needs the library in shared_preload_libraries, on the standbys too.",
+							 &ia_wal_row_images,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_directpaths.direct_redo",
+							 "WAL-logs the pages written by direct path inserts with chunk records, replayed without the shared buffers.",
+							 "Needs the library in shared_preload_libraries, on the standbys too.",
+							 &ia_direct_redo,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_directpaths.wal_workers",
+							"Number of background workers WAL-logging the pages written by a direct path insert.",
+							"0 WAL-logs them in the inserting backend.",
+							&ia_wal_workers,
+							0,
+							0,
+							IA_MAX_WAL_WORKERS,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_directpaths.max_wal_rate",
+							"Maximum rate of the WAL written by a direct path insert, in MB/s.",
+							"0 does not limit it.",
+							&ia_max_wal_rate,
+							0,
+							0,
+							INT_MAX / 1024,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_directpaths.max_write_rate",
+							"Maximum rate of the data written by a direct path insert, in MB/s.",
+							"0 does not limit it.",
+							&ia_max_write_rate,
+							0,
+							0,
+							INT_MAX / 1024,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_directpaths.max_replication_lag",
+							"Replay lag of the standbys beyond which a direct path insert waits for them.",
+							"0 does not wait.",
+							&ia_max_replication_lag,
+							0,
+							0,
+							MAX_KILOBYTES,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_directpaths.replication_lag_timeout",
+							"Time a direct path insert waits for the standbys to catch up.",
+							"Past it, the insert goes on without waiting for them. 0 waits without limit.",
+							&ia_replication_lag_timeout,
+							60000,
+							0,
+							INT_MAX,
+							PGC_USERSET,
+							GUC_UNIT_MS,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_directpaths.logical_messages",
+							 "Emits the rows of direct path inserts as logical messages for logical decoding.",
+							 "Needs wal_level = logical.",
+							 &ia_logical_messages,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_directpaths.pipeline",
+							 "Builds and writes the pages of direct path inserts in a background worker fed by the inserting backend.",
+							 NULL,
+							 &ia_pipeline,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("pg_directpaths.index_merge_ratio",
+							"Maximum share of the relation, in percent, appended by a direct path insert for its B-tree indexes to get the new rows rather than being rebuilt.",
+							"0 always rebuilds them.",
+							&ia_index_merge_ratio,
+							20,
+							0,
+							100,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("pg_directpaths.index_spool",
+							 "Sorts the B-tree keys of the rows as they are loaded into an empty relation, for its indexes to be built without reading it again.",
+							 NULL,
+							 &ia_index_spool,
+							 true,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= PG_VERSION_15
+	MarkGUCPrefixReserved("pg_directpaths");
+#else
+	EmitWarningsOnPlaceholders("pg_directpaths");
+#endif
+
+	IAXLogInit();
+
+	RegisterXactCallback(IAWriterXactCallback, NULL);
+	RegisterSubXactCallback(IAWriterSubXactCallback, NULL);
 }
 
 void _PG_fini(void)
 {
     planner_hook = prev_planner_hook;
     post_parse_analyze_hook = prev_post_parse_analyze_hook;
+	UnregisterXactCallback(IAWriterXactCallback, NULL);
+	UnregisterSubXactCallback(IAWriterSubXactCallback, NULL);
 }
\ No newline at end of file
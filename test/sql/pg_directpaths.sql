@@ -93,3 +93,185 @@ create table toasttest(descr text, cnt int DEFAULT 0, f1 text, f2 text);
 /*+ APPEND */ insert INTO toasttest(descr, f1, f2) VALUES('two-toasted', repeat('1234567890',30000), repeat('1234567890',50000));
 select relname from pg_class where oid = (select reltoastrelid from pg_class where relname='toasttest');\gset
 select substring(chunk_data::text, 1, 10)  from pg_toast.:relname;
+
+-- direct I/O
+create table dio (a int, b text);
+set pg_directpaths.direct_io = on;
+/*+ APPEND */ insert into dio select a, repeat('x', 100) from generate_series(1, 200000) a;
+reset pg_directpaths.direct_io;
+select count(*), sum(a) from dio;
+
+-- checkpointer sync mode
+create table ckpt (a int, b text);
+set pg_directpaths.sync_mode = checkpointer;
+/*+ APPEND */ insert into ckpt select a, repeat('x', 100) from generate_series(1, 200000) a;
+reset pg_directpaths.sync_mode;
+checkpoint;
+select count(*), sum(a) from ckpt;
+
+-- relation created in the same transaction
+begin;
+create table sametx (a int, b text);
+/*+ APPEND */ insert into sametx select a, repeat('x', 100) from generate_series(1, 10000) a;
+commit;
+select count(*), sum(a) from sametx;
+
+-- WAL workers
+create table walw (a int, b text);
+set pg_directpaths.wal_workers = 2;
+/*+ APPEND */ insert into walw select a, repeat('x', 100) from generate_series(1, 200000) a;
+reset pg_directpaths.wal_workers;
+select count(*), sum(a) from walw;
+
+-- throttling
+create table throttled (a int, b text);
+set pg_directpaths.max_wal_rate = 100;
+set pg_directpaths.max_write_rate = 100;
+set pg_directpaths.max_replication_lag = '1GB';
+/*+ APPEND */ insert into throttled select a, repeat('x', 100) from generate_series(1, 200000) a;
+reset pg_directpaths.max_wal_rate;
+reset pg_directpaths.max_write_rate;
+reset pg_directpaths.max_replication_lag;
+select count(*), sum(a) from throttled;
+
+-- logical decoding
+create table logi (a int, b text);
+select 'init' from pg_create_logical_replication_slot('ia_slot', 'pg_directpaths');
+set pg_directpaths.logical_messages = on;
+/*+ APPEND */ insert into logi select a, 'x' || a from generate_series(1, 3) a;
+reset pg_directpaths.logical_messages;
+select data from pg_logical_slot_get_changes('ia_slot', NULL, NULL);
+select pg_drop_replication_slot('ia_slot');
+
+-- direct redo
+create table dredo (a int, b text);
+set pg_directpaths.direct_redo = on;
+/*+ APPEND */ insert into dredo select a, repeat('x', 100) from generate_series(1, 10000) a;
+reset pg_directpaths.direct_redo;
+select count(*), sum(a) from dredo;
+
+-- pipeline
+create table piped (a int, b text);
+set pg_directpaths.pipeline = on;
+/*+ APPEND */ insert into piped select a, repeat('x', 100) from generate_series(1, 200000) a;
+reset pg_directpaths.pipeline;
+select count(*), sum(a) from piped;
+
+-- parallel insert
+create table parsrc as select a, repeat('x', 100) as b from generate_series(1, 200000) a;
+create table para (a int, b text);
+set parallel_setup_cost = 0;
+set min_parallel_table_scan_size = 0;
+/*+ APPEND PARALLEL(2) */ insert into para select * from parsrc;
+reset parallel_setup_cost;
+reset min_parallel_table_scan_size;
+select count(*), sum(a) from para;
+
+-- parallel source query
+create table parread (a int, b text);
+set parallel_setup_cost = 0;
+set min_parallel_table_scan_size = 0;
+/*+ APPEND */ insert into parread select a, b from parsrc where a % 2 = 0;
+reset parallel_setup_cost;
+reset min_parallel_table_scan_size;
+select count(*), sum(a) from parread;
+
+-- incremental index maintenance
+create table merged (a int, b text);
+create unique index merged_a on merged (a);
+create index merged_lower on merged (lower(b)) where a % 2 = 0;
+insert into merged select a, 'X' || a from generate_series(1, 100000) a;
+/*+ APPEND */ insert into merged select a, 'X' || a from generate_series(100001, 101000) a;
+set enable_seqscan = off;
+select count(*) from merged where a > 99990;
+select a from merged where lower(b) = 'x100500' and a % 2 = 0;
+reset enable_seqscan;
+/*+ APPEND */ insert into merged values (5, 'dup');
+
+-- concurrent index builds
+create table multidx (a int, b int, c text);
+create unique index multidx_a on multidx (a);
+create index multidx_b on multidx (b);
+create index multidx_c on multidx (c);
+set pg_directpaths.index_spool = off;
+/*+ APPEND */ insert into multidx select a, a % 1000, 'c' || a from generate_series(1, 100000) a;
+reset pg_directpaths.index_spool;
+set enable_seqscan = off;
+set enable_bitmapscan = off;
+select count(*) from multidx where a > 99990;
+select count(*) from multidx where b = 7;
+select a from multidx where c = 'c4242';
+reset enable_seqscan;
+reset enable_bitmapscan;
+
+-- index keys spooled during the load
+create table spooled (a int, b text);
+create unique index spooled_a on spooled (a);
+create index spooled_lower on spooled (lower(b)) where a % 2 = 0;
+/*+ APPEND */ insert into spooled select a, 'X' || a from generate_series(1, 100000) a;
+set enable_seqscan = off;
+set enable_bitmapscan = off;
+select count(*) from spooled where a > 99990;
+select a from spooled where lower(b) = 'x500' and a % 2 = 0;
+reset enable_seqscan;
+reset enable_bitmapscan;
+create table spooldup (a int);
+create unique index spooldup_a on spooldup (a);
+/*+ APPEND */ insert into spooldup values (1), (2), (1);
+
+-- index keys loaded in order
+create table streamed (a int, b int);
+create index streamed_a on streamed (a);
+create index streamed_b on streamed (b desc);
+/*+ APPEND */ insert into streamed select a, 100000 - a from generate_series(1, 100000) a union all select 0, 0;
+set enable_seqscan = off;
+set enable_bitmapscan = off;
+select count(*) from streamed where a < 10;
+select count(*) from streamed where b > 99990;
+select a from streamed where b = 0 order by a;
+reset enable_seqscan;
+reset enable_bitmapscan;
+create table streamdup (a int primary key);
+/*+ APPEND */ insert into streamdup values (1), (2), (2);
+
+-- BRIN ranges of the appended blocks summarized
+create table brinned (a int);
+create index brinned_a on brinned using brin (a) with (pages_per_range = 4);
+insert into brinned select generate_series(1, 10000);
+/*+ APPEND */ insert into brinned select generate_series(10001, 20000);
+set enable_seqscan = off;
+select count(*) from brinned where a between 9990 and 10010;
+select count(*) from brinned where a > 19990;
+reset enable_seqscan;
+
+-- external values of another relation
+create table extsrc (a int, b text);
+alter table extsrc alter column b set storage external;
+insert into extsrc select a, repeat(md5(a::text), 100) from generate_series(1, 2000) a;
+create table extdst (a int, b text);
+set parallel_setup_cost = 0;
+set min_parallel_table_scan_size = 0;
+/*+ APPEND PARALLEL(2) */ insert into extdst select * from extsrc;
+/*+ APPEND */ insert into extdst select * from extsrc;
+reset parallel_setup_cost;
+reset min_parallel_table_scan_size;
+drop table extsrc;
+select count(*), sum(length(b)), sum(a) from extdst;
+
+-- index read while its keys are loaded
+create table idxread (a int);
+create index idxread_a on idxread (a);
+CREATE FUNCTION idxread_lookup() RETURNS TRIGGER AS
+$$
+BEGIN
+PERFORM 1 FROM idxread WHERE a = NEW.a;
+RETURN NEW;
+END;
+$$ LANGUAGE plpgsql;
+CREATE TRIGGER idxread_trig BEFORE INSERT ON idxread FOR EACH ROW EXECUTE PROCEDURE idxread_lookup();
+set enable_seqscan = off;
+set enable_bitmapscan = off;
+/*+ APPEND */ insert into idxread select a from generate_series(1, 10000) a;
+select count(*) from idxread where a > 9990;
+reset enable_seqscan;
+reset enable_bitmapscan;
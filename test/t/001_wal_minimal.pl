@@ -0,0 +1,74 @@
+# Direct path inserts skipping the WAL with wal_level = minimal: the rows
+# must survive a crash once the transaction is committed.
+use strict;
+use warnings;
+use Test::More;
+
+my $node;
+
+# the TAP modules were renamed in PostgreSQL 15
+if (eval { require PostgreSQL::Test::Cluster; 1 })
+{
+	$node = PostgreSQL::Test::Cluster->new('minimal');
+}
+else
+{
+	require PostgresNode;
+	$node = PostgresNode::get_new_node('minimal');
+}
+
+$node->init;
+$node->append_conf(
+	'postgresql.conf', q{
+wal_level = minimal
+max_wal_senders = 0
+shared_preload_libraries = 'pg_directpaths'
+});
+$node->start;
+
+$node->safe_psql('postgres',
+	'create table truncated (a int, b text); insert into truncated values (0, null);');
+
+my $start_lsn = $node->safe_psql('postgres', 'select pg_current_wal_lsn()');
+
+$node->safe_psql(
+	'postgres', q{
+begin;
+create table created (a int, b text);
+create index created_a on created (a);
+/*+ APPEND */ insert into created select a, repeat('x', 100) from generate_series(1, 100000) a;
+commit;
+begin;
+truncate truncated;
+/*+ APPEND */ insert into truncated select a, repeat('x', 100) from generate_series(1, 100000) a;
+commit;
+});
+
+# the pages were synced rather than logged
+my $wal_bytes = $node->safe_psql('postgres',
+	"select pg_current_wal_lsn() - '$start_lsn'::pg_lsn");
+my $rel_bytes = $node->safe_psql('postgres',
+	"select pg_relation_size('created') + pg_relation_size('truncated')");
+cmp_ok($wal_bytes, '<', $rel_bytes / 2, 'the new pages are not WAL-logged');
+
+$node->stop('immediate');
+$node->start;
+
+is( $node->safe_psql('postgres', 'select count(*), sum(a) from created'),
+	'100000|5000050000',
+	'rows of the relation created in the transaction survive a crash');
+is( $node->safe_psql('postgres', 'select count(*), sum(a) from truncated'),
+	'100000|5000050000',
+	'rows of the relation truncated in the transaction survive a crash');
+is( $node->safe_psql(
+		'postgres', q{
+set enable_seqscan = off;
+set enable_bitmapscan = off;
+select count(*) from created where a > 99990;
+}),
+	'10',
+	'the index of the relation survives a crash');
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,89 @@
+# Direct path pages logged with the records of the custom resource manager:
+# compressed, as row images and replayed directly.  A streaming standby and
+# crash recovery must rebuild the same relations.
+use strict;
+use warnings;
+use Test::More;
+
+# custom resource managers came with PostgreSQL 15, as did these modules
+if (!eval { require PostgreSQL::Test::Cluster; require PostgreSQL::Test::Utils; 1 })
+{
+	plan skip_all => 'custom WAL resource managers require PostgreSQL 15';
+}
+
+my $primary = PostgreSQL::Test::Cluster->new('primary');
+$primary->init(allows_streaming => 1);
+$primary->append_conf(
+	'postgresql.conf', q{
+shared_preload_libraries = 'pg_directpaths'
+});
+$primary->start;
+$primary->backup('backup');
+
+my $standby = PostgreSQL::Test::Cluster->new('standby');
+$standby->init_from_backup($primary, 'backup', has_streaming => 1);
+$standby->start;
+
+my %loads = (
+	direct => 'set pg_directpaths.direct_redo = on;',
+	compressed => 'set pg_directpaths.wal_compression = pglz;',
+	rows => 'set pg_directpaths.wal_row_images = on;',
+	compressed_rows =>
+	  'set pg_directpaths.wal_row_images = on; set pg_directpaths.wal_compression = pglz;');
+
+my $check = q{select count(*), sum(a), md5(string_agg(b, ',' order by a)) from %s};
+
+my $start_lsn = $primary->safe_psql('postgres', 'select pg_current_wal_lsn()');
+
+foreach my $table (sort keys %loads)
+{
+	# appended after a page of regular rows, and to an empty relation
+	$primary->safe_psql(
+		'postgres', qq{
+create table $table (a int, b text);
+insert into $table select a, 'r' || a from generate_series(1, 10) a;
+$loads{$table}
+/*+ APPEND */ insert into $table select a, repeat('x', a % 200) from generate_series(11, 50000) a;
+create table ${table}_empty (a int, b text);
+$loads{$table}
+/*+ APPEND */ insert into ${table}_empty select a, md5(a::text) from generate_series(1, 50000) a;
+});
+}
+
+my $end_lsn = $primary->safe_psql('postgres', 'select pg_current_wal_flush_lsn()');
+
+# the pages went through the records of the custom resource manager
+my ($stdout, $stderr) = PostgreSQL::Test::Utils::run_command(
+	[
+		'pg_waldump', '--stats',
+		'--path' => $primary->data_dir . '/pg_wal',
+		'--start' => $start_lsn,
+		'--end' => $end_lsn
+	]);
+like($stdout, qr/custom\d{3}/, 'the pages are logged by the custom resource manager');
+
+my %expected;
+foreach my $table (map { ($_, "${_}_empty") } sort keys %loads)
+{
+	$expected{$table} = $primary->safe_psql('postgres', sprintf($check, $table));
+}
+
+$primary->wait_for_catchup($standby);
+
+foreach my $table (sort keys %expected)
+{
+	is($standby->safe_psql('postgres', sprintf($check, $table)),
+		$expected{$table}, "$table replayed on the standby");
+}
+
+# replayed again over the pages already written, from the last checkpoint
+$primary->stop('immediate');
+$primary->start;
+
+foreach my $table (sort keys %expected)
+{
+	is($primary->safe_psql('postgres', sprintf($check, $table)),
+		$expected{$table}, "$table replayed by crash recovery");
+}
+
+done_testing();